@@ -0,0 +1,227 @@
+#!/usr/bin/env lua
+
+--
+--  Copyright 2016, Grinn
+--
+--  SPDX-License-Identifier: MIT
+--
+
+-- Benchmark cases, run through run.sh. Results are printed as JSON.
+
+local dbus = require 'easydbus'
+
+local SERVICE = 'easydbus.bench'
+local PATH = '/easydbus/bench'
+local INTERFACE = 'easydbus.Bench'
+
+local usage = [[
+Usage: bench.lua [options]
+
+Options:
+  -o, --output FILE   write JSON results to FILE instead of stdout
+  -q, --quick         run 10 times less iterations
+  -c, --case NAME     run only case NAME (may be repeated)
+  -h, --help          show this help
+]]
+
+local opts = {cases = {}, scale = 1}
+do
+   local i = 1
+   while i <= #arg do
+      local a = arg[i]
+      if a == '-o' or a == '--output' then
+         opts.output = arg[i+1]
+         i = i + 1
+      elseif a == '-q' or a == '--quick' then
+         opts.scale = 0.1
+      elseif a == '-c' or a == '--case' then
+         opts.cases[arg[i+1]] = true
+         i = i + 1
+      elseif a == '-h' or a == '--help' then
+         io.write(usage)
+         os.exit(0)
+      else
+         io.stderr:write(usage)
+         os.exit(1)
+      end
+      i = i + 1
+   end
+end
+
+local bus = assert(dbus.session())
+
+local function wait_for_service()
+   for _ = 1, 100 do
+      local has_owner = bus:call('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus',
+                                 'NameHasOwner', 's', SERVICE)
+      if has_owner then
+         return
+      end
+      os.execute('sleep 0.1')
+   end
+   error('Service ' .. SERVICE .. ' did not start')
+end
+
+local function percentile(sorted, p)
+   return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+-- Runs func(i) n times inside mainloop, one at a time
+local function measure(n, func)
+   local latencies = {}
+   local start, stop
+
+   dbus.reset_marshal_stats()
+   dbus.set_marshal_stats(true)
+   dbus.add_callback(function()
+      start = dbus.monotonic_time()
+      for i = 1, n do
+         local t = dbus.monotonic_time()
+         func(i)
+         latencies[i] = dbus.monotonic_time() - t
+      end
+      stop = dbus.monotonic_time()
+      dbus.mainloop_quit()
+   end)
+   dbus.mainloop()
+   dbus.set_marshal_stats(false)
+
+   local marshal = dbus.marshal_stats()
+   table.sort(latencies)
+   return {
+      iterations = n,
+      ops_per_s = n / ((stop - start) / 1000000),
+      p50_us = percentile(latencies, 0.5),
+      p99_us = percentile(latencies, 0.99),
+      max_us = latencies[n],
+      encode_us = marshal.encode.time_us / math.max(1, marshal.encode.calls),
+      decode_us = marshal.decode.time_us / math.max(1, marshal.decode.calls),
+      encode_bytes = marshal.encode.bytes / math.max(1, marshal.encode.calls),
+   }
+end
+
+local function call_case(n, method, sig, value)
+   return measure(n, function()
+      assert(bus:call(SERVICE, PATH, INTERFACE, method, sig, value))
+   end)
+end
+
+local function range(n, func)
+   local t = {}
+   for i = 1, n do
+      t[i] = func(i)
+   end
+   return t
+end
+
+local cases = {
+   {'empty_call', 10000, function(n)
+      return measure(n, function()
+         bus:call(SERVICE, PATH, INTERFACE, 'Empty')
+      end)
+   end},
+   {'dict_call', 5000, function(n)
+      local dict = {}
+      for i = 1, 20 do
+         dict['key' .. i] = i % 2 == 0 and i or ('value' .. i)
+      end
+      return call_case(n, 'Dict', 'a{sv}', dict)
+   end},
+   {'bytes_1m_call', 20, function(n)
+      return call_case(n, 'Bytes', 'ay', range(1024 * 1024, function(i) return i % 256 end))
+   end},
+   {'array_100k_call', 50, function(n)
+      return call_case(n, 'Array', 'ai', range(100000, function(i) return i end))
+   end},
+   {'signal', 10000, function(n)
+      local receiver = assert(dbus.connect('session'))
+      local received = 0
+      local start, emitted, last
+
+      receiver:subscribe(nil, PATH, INTERFACE, 'Tick', function()
+         received = received + 1
+         last = dbus.monotonic_time()
+         if received == n then
+            dbus.mainloop_quit()
+         end
+      end)
+
+      dbus.add_callback(function()
+         start = dbus.monotonic_time()
+         for i = 1, n do
+            bus:emit(nil, PATH, INTERFACE, 'Tick', 'u', i)
+         end
+         emitted = dbus.monotonic_time()
+      end)
+      local timeout = dbus.add_timeout(10000, dbus.mainloop_quit)
+      dbus.mainloop()
+      dbus.remove_timeout(timeout)
+      receiver:close()
+
+      return {
+         iterations = n,
+         received = received,
+         emit_per_s = n / ((emitted - start) / 1000000),
+         receive_per_s = last and received / ((last - start) / 1000000) or 0,
+      }
+   end},
+}
+
+-- Minimal JSON encoder for flat tables of numbers and strings
+local function to_json(value, indent)
+   indent = indent or ''
+   if type(value) == 'number' then
+      -- JSON has no representation of nan and infinities
+      if value ~= value or value == math.huge or value == -math.huge then
+         return 'null'
+      elseif value == math.floor(value) then
+         return string.format('%.0f', value)
+      end
+      return string.format('%.3f', value)
+   elseif type(value) == 'string' then
+      return '"' .. value:gsub('[%c"\\]', function(c)
+         return string.format('\\u%04x', c:byte())
+      end) .. '"'
+   elseif #value > 0 then
+      local items = {}
+      for i,v in ipairs(value) do
+         items[i] = indent .. '  ' .. to_json(v, indent .. '  ')
+      end
+      return '[\n' .. table.concat(items, ',\n') .. '\n' .. indent .. ']'
+   else
+      local keys = {}
+      for k in pairs(value) do
+         keys[#keys+1] = k
+      end
+      table.sort(keys)
+      local items = {}
+      for i,k in ipairs(keys) do
+         items[i] = string.format('%s  "%s": %s', indent, k, to_json(value[k], indent .. '  '))
+      end
+      return '{\n' .. table.concat(items, ',\n') .. '\n' .. indent .. '}'
+   end
+end
+
+wait_for_service()
+
+local results = {}
+for _,case in ipairs(cases) do
+   local name, n, func = case[1], case[2], case[3]
+   if not next(opts.cases) or opts.cases[name] then
+      io.stderr:write('Running ' .. name .. '\n')
+      local result = func(math.max(1, math.floor(n * opts.scale)))
+      result.name = name
+      results[#results+1] = result
+   end
+end
+
+bus:call(SERVICE, PATH, INTERFACE, 'Quit')
+
+local json = to_json({lua = _VERSION, cases = results}) .. '\n'
+if opts.output then
+   local file = assert(io.open(opts.output, 'w'))
+   file:write(json)
+   file:close()
+else
+   io.write(json)
+end
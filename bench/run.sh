@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Copyright 2016, Grinn
+#
+# SPDX-License-Identifier: MIT
+#
+# Runs benchmarks against a private session bus.
+#
+# Usage: run.sh [bench.lua options]
+#
+# Environment:
+#   LUA             Lua interpreter (default: lua)
+#   EASYDBUS_CPATH  directory containing easydbus/core.so (default: installed one)
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+if [ -z "$EASYDBUS_BENCH_BUS" ]; then
+    export EASYDBUS_BENCH_BUS=1
+    exec dbus-run-session -- "$0" "$@"
+fi
+
+LUA=${LUA:-lua}
+export LUA_PATH="$BENCH_DIR/../src/?.lua;$BENCH_DIR/?.lua;${LUA_PATH:-;}"
+if [ -n "$EASYDBUS_CPATH" ]; then
+    export LUA_CPATH="$EASYDBUS_CPATH/?.so;${LUA_CPATH:-;}"
+fi
+
+"$LUA" "$BENCH_DIR/service.lua" &
+SERVICE_PID=$!
+trap 'kill $SERVICE_PID 2>/dev/null || true' EXIT
+
+"$LUA" "$BENCH_DIR/bench.lua" "$@"
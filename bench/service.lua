@@ -0,0 +1,37 @@
+#!/usr/bin/env lua
+
+--
+--  Copyright 2016, Grinn
+--
+--  SPDX-License-Identifier: MIT
+--
+
+-- Service used by bench.lua, run in a separate process
+
+local dbus = require 'easydbus'
+
+local SERVICE = 'easydbus.bench'
+local PATH = '/easydbus/bench'
+local INTERFACE = 'easydbus.Bench'
+
+local bus = assert(dbus.session())
+
+local object = dbus.object(PATH, INTERFACE)
+object:add_method('Empty', '', '', function() end)
+object:add_method('Dict', 'a{sv}', 'u', function(dict)
+   local n = 0
+   for _ in pairs(dict) do
+      n = n + 1
+   end
+   return n
+end)
+object:add_method('Bytes', 'ay', 'u', function(bytes) return #bytes end)
+object:add_method('Array', 'ai', 'u', function(array) return #array end)
+object:add_method('Quit', '', '', function()
+   dbus.add_callback(dbus.mainloop_quit)
+end)
+
+assert(bus:register_object(object))
+assert(bus:own_name(SERVICE))
+
+dbus.mainloop()
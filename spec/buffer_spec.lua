@@ -0,0 +1,119 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+local dbus = require 'easydbus'
+
+local pack = table.pack or dbus.pack
+local unpack = unpack or table.unpack
+
+local bus_name = 'session'
+local service_name = 'spec.easydbus'
+local object_path = '/spec/easydbus'
+local interface_name = 'spec.easydbus'
+
+describe('Buffer', function()
+   it('Create from size, string and table', function()
+      local buffer = dbus.buffer(4)
+      assert.are.equal(4, #buffer)
+      assert.are.equal(0, buffer[1])
+
+      buffer = dbus.buffer('abc')
+      assert.are.equal(3, #buffer)
+      assert.are.equal(98, buffer[2])
+      assert.are.equal('bc', buffer:tostring(2))
+
+      buffer = dbus.buffer({1.5, 2.5}, 'f64')
+      assert.are.equal('f64', buffer:type())
+      assert.are.same({1.5, 2.5}, buffer:totable())
+   end)
+
+   it('Reject invalid arguments', function()
+      local function error_of(...)
+         local ok, err = pcall(dbus.buffer, ...)
+         assert.is_false(ok)
+         return err
+      end
+      assert.is_truthy(error_of(-1):find('#1', 1, true))
+      assert.is_truthy(error_of(math.maxinteger or 2^62, 'f64'):find('#1', 1, true))
+      assert.is_truthy(error_of({1, 'x'}):find('#1', 1, true))
+      assert.is_truthy(error_of(1, 'u16'):find('#2', 1, true))
+   end)
+
+   it('Set elements', function()
+      local buffer = dbus.buffer(2, 'i32')
+      buffer[1] = -5
+      buffer[2] = 7
+      assert.are.same({-5, 7}, buffer:totable())
+      assert.has_error(function() buffer[3] = 1 end)
+   end)
+
+   it('Resize', function()
+      local buffer = dbus.buffer('ab')
+      buffer:resize(4)
+      assert.are.same({97, 98, 0, 0}, buffer:totable())
+      buffer:resize(1)
+      assert.are.equal('a', buffer:tostring())
+   end)
+
+   it('Slices and views share memory', function()
+      local buffer = dbus.buffer({1, 2, 3, 4}, 'i32')
+      local slice = buffer:slice(2, 3)
+      assert.are.same({2, 3}, slice:totable())
+      slice[1] = 20
+      assert.are.equal(20, buffer[2])
+      assert.are.equal(16, #buffer:u8())
+      assert.has_error(function() slice:resize(1) end)
+   end)
+end)
+
+describe('Buffer in method calls', function()
+   local bus, owner_id, object_id
+
+   before_each(function()
+      bus = assert(dbus[bus_name]())
+      owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('sum', 'ad', 'd', function(array)
+         local sum = 0
+         for i = 1, #array do
+            sum = sum + array[i]
+         end
+         return sum
+      end)
+      object:add_method('bytes', 'ay', 'ay', function(bytes) return bytes end)
+      object_id = assert(bus:register_object(object))
+   end)
+
+   after_each(function()
+      dbus.buffer_arrays(false)
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   local function call(...)
+      local args = pack(...)
+      local ret
+      dbus.add_callback(function()
+         ret = pack(bus:call(service_name, object_path, interface_name, unpack(args, 1, args.n)))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      return ret
+   end
+
+   it('Send buffer as array', function()
+      assert.are.same(pack(6.5), call('sum', 'ad', dbus.buffer({1, 2, 3.5}, 'f64')))
+   end)
+
+   it('Send string as byte array', function()
+      assert.are.same(pack({104, 105}), call('bytes', 'ay', 'hi'))
+   end)
+
+   it('Receive arrays as buffers', function()
+      dbus.buffer_arrays(true)
+      local ret = call('bytes', 'ay', 'hello')
+      assert.are.equal('hello', ret[1]:tostring())
+      assert.has_error(function() ret[1][1] = 0 end)
+   end)
+end)
@@ -0,0 +1,33 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+local dbus = require 'easydbus'
+local cqueues = require 'cqueues'
+local adapter = require 'easydbus.cqueues'
+
+local bus_name = 'session'
+
+describe('cqueues adapter', function()
+   it('Wrap, call, unwrap and wrap again', function()
+      local cq = cqueues.new()
+      local bus = assert(dbus[bus_name]())
+
+      for i = 1, 2 do
+         local ret
+         adapter.wrap(dbus, cq)
+         cq:wrap(function()
+            ret = bus:call('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus', 'GetId')
+            adapter.unwrap()
+         end)
+
+         -- watcher must end on unwrap, so loop finishes
+         assert(cq:loop(5))
+         assert.is_true(cq:empty(), 'round ' .. i)
+         assert.is_string(ret, 'round ' .. i)
+      end
+
+      -- calls are synchronous again
+      assert.is_string(bus:call('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus', 'GetId'))
+   end)
+end)
@@ -0,0 +1,114 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+local dbus = require 'easydbus'
+
+local pack = table.pack or dbus.pack
+
+describe('Callbacks', function()
+   it('Callback arguments', function()
+      local args
+      dbus.add_callback(function(...)
+         args = pack(...)
+         dbus.mainloop_quit()
+      end, 'a', nil, 3)
+      dbus.mainloop()
+
+      assert.are.same(pack('a', nil, 3), args)
+   end)
+
+   it('Callbacks run in order of priority', function()
+      local order = {}
+      local function cb(name)
+         order[#order+1] = name
+         if #order == 4 then
+            dbus.mainloop_quit()
+         end
+      end
+      dbus.add_priority_callback('low', cb, 'low')
+      dbus.add_callback(cb, 'default1')
+      dbus.add_priority_callback('high', cb, 'high')
+      dbus.add_priority_callback('default', cb, 'default2')
+      dbus.mainloop()
+
+      assert.are.same({'high', 'default1', 'default2', 'low'}, order)
+   end)
+
+   it('Callback budget', function()
+      local n = 0
+      local seen
+      dbus.set_callback_budget(2)
+      -- timeout added by first callback must fire between drains
+      dbus.add_callback(function()
+         n = n + 1
+         dbus.add_timeout(0, function() seen = n end)
+      end)
+      for _ = 2, 10 do
+         dbus.add_callback(function()
+            n = n + 1
+            if n == 10 then
+               dbus.mainloop_quit()
+            end
+         end)
+      end
+      dbus.mainloop()
+      dbus.set_callback_budget(0)
+
+      assert.are.equal(10, n)
+      assert.are.equal(2, seen)
+   end)
+
+   it('Wrong priority', function()
+      assert.has_error(function()
+         dbus.add_priority_callback('highest', function() end)
+      end)
+   end)
+end)
+
+describe('Timers', function()
+   it('Timeout', function()
+      local args
+      dbus.add_timeout(10, function(...)
+         args = pack(...)
+         dbus.mainloop_quit()
+      end, 'arg')
+      dbus.mainloop()
+
+      assert.are.same(pack('arg'), args)
+   end)
+
+   it('Interval', function()
+      local n = 0
+      local id
+      id = dbus.add_interval(1, function()
+         n = n + 1
+         if n == 3 then
+            assert.is_true(dbus.remove_timeout(id))
+            dbus.add_timeout(10, dbus.mainloop_quit)
+         end
+      end)
+      dbus.mainloop()
+
+      assert.are.equal(3, n)
+   end)
+
+   it('Cancelled timeout', function()
+      local handler = spy.new(function() end)
+      local id = dbus.add_timeout(1, handler)
+      assert.is_true(dbus.remove_timeout(id))
+      dbus.add_timeout(10, dbus.mainloop_quit)
+      dbus.mainloop()
+
+      assert.spy(handler).was_not_called()
+      assert.is_false(dbus.remove_timeout(id))
+   end)
+
+   it('Seconds timeout', function()
+      local handler = spy.new(function() dbus.mainloop_quit() end)
+      dbus.add_timeout_seconds(1, handler)
+      dbus.mainloop()
+
+      assert.spy(handler).was_called()
+   end)
+end)
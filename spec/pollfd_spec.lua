@@ -0,0 +1,122 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+local dbus = require 'easydbus'
+
+local resume = coroutine.resume
+local running = coroutine.running
+local yield = coroutine.yield
+local unpack = unpack or table.unpack
+
+local bus_name = 'session'
+local service_name = 'spec.easydbus'
+local object_path = '/spec/easydbus'
+local interface_name = 'spec.easydbus'
+
+-- appends resume callback for currently running coroutine
+local function task(func, ...)
+   local n = select('#', ...)
+   local args = {...}
+   args[n+1] = resume
+   args[n+2] = running()
+   return func(unpack(args, 1, n+2))
+end
+
+-- dispatches until done() returns true, as host loop would do when fd fires
+local function run_until(done)
+   local deadline = dbus.monotonic_time() + 5000000
+   while not done() do
+      assert.is_true(dbus.monotonic_time() < deadline, 'timed out')
+      dbus.dispatch()
+   end
+end
+
+describe('Single fd mode', function()
+   local restore
+
+   setup(function()
+      assert.is_number(dbus.pollfd())
+      restore = dbus.wrap_async(function(func)
+         return function(...)
+            return yield(task(func, ...))
+         end
+      end)
+   end)
+
+   teardown(function()
+      restore()
+      dbus.close_pollfd()
+   end)
+
+   it('Returns the same fd', function()
+      assert.are.equal(dbus.pollfd(), dbus.pollfd())
+   end)
+
+   it('Dispatch timeout', function()
+      local fired = false
+      dbus.add_timeout(10, function() fired = true end)
+      run_until(function() return fired end)
+   end)
+
+   it('Dispatch budget', function()
+      local n = 0
+      -- always ready, so without budget dispatch() would never return
+      local id = dbus.add_interval(0, function() n = n + 1 end)
+      local hits = dbus.dispatch_stats().budget_hits
+      dbus.set_dispatch_budget(2)
+      dbus.dispatch()
+      dbus.set_dispatch_budget(0)
+      dbus.remove_timeout(id)
+
+      assert.is_true(n <= 3)
+      assert.are.equal(hits + 1, dbus.dispatch_stats().budget_hits)
+   end)
+
+   it('Call method', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 's', 's', function(s) return s end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call(service_name, object_path, interface_name, 'echo', 's', 'epoll')
+      end)
+      run_until(function() return ret end)
+      assert.are.equal('epoll', ret)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Call outside of coroutine blocks', function()
+      local bus = assert(dbus[bus_name]())
+      assert.is_string(bus:call('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus', 'GetId'))
+   end)
+
+   it('Call over reopened connection', function()
+      -- closed connection fd number is likely to be reused by the next one
+      for i = 1, 3 do
+         local ret
+         dbus.add_callback(function()
+            local conn = assert(dbus.connect(bus_name))
+            ret = conn:call('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus', 'GetId')
+            conn:close()
+         end)
+         run_until(function() return ret end)
+         assert.is_string(ret, 'round ' .. i)
+      end
+   end)
+end)
+
+describe('Leaving single fd mode', function()
+   it('Calls are synchronous again', function()
+      assert.is_number(dbus.pollfd())
+      dbus.close_pollfd()
+
+      local bus = assert(dbus[bus_name]())
+      assert.is_string(bus:call('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus', 'GetId'))
+   end)
+end)
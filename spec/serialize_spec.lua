@@ -0,0 +1,62 @@
+#!/usr/bin/env lua
+
+require 'busted.runner'()
+
+local dbus = require 'easydbus'
+
+describe('Serialization', function()
+   it('Serialize and deserialize values', function()
+      local data = dbus.serialize('sa{sv}x', 'name', {a = 1, b = {true, 'x'}}, 2^40)
+      assert.are.equal('string', type(data))
+
+      local s, d, x = dbus.deserialize('sa{sv}x', data)
+      assert.are.equal('name', s)
+      assert.are.same({a = 1, b = {true, 'x'}}, d)
+      assert.are.equal(2^40, x)
+   end)
+
+   it('Deserialize from buffer', function()
+      local data = dbus.serialize('ai', {1, 2, 3})
+      assert.are.same({1, 2, 3}, dbus.deserialize('ai', dbus.buffer(data)))
+   end)
+
+   it('Invalid data', function()
+      local ret, err = dbus.deserialize('s', 'abc')
+      assert.is_nil(ret)
+      assert.are.equal('Invalid serialized data', err)
+      assert.has_error(function() dbus.deserialize('a{', '') end)
+   end)
+
+   it('Invalid signature', function()
+      assert.has_error(function() dbus.serialize('a{', {}) end)
+      assert.has_error(function() dbus.serialize('i', 1, 2) end)
+      assert.has_error(function() dbus.serialize('ii', 1) end)
+   end)
+
+   it('Load snapshot lazily', function()
+      local path = os.tmpname()
+      local f = assert(io.open(path, 'wb'))
+      f:write(dbus.serialize('a{sv}ai', {version = 'v1', config = {depth = 3}}, {10, 20, 30}))
+      f:close()
+
+      local snapshot = assert(dbus.load(path, 'a{sv}ai'))
+      os.remove(path)
+
+      assert.are.equal('a{sv}ai', snapshot:type())
+      assert.are.equal(2, #snapshot)
+      assert.are.equal('v1', snapshot:get(1, 'version'))
+      assert.are.equal(3, snapshot:get(1, 'config', 'depth'))
+      assert.are.equal(20, snapshot:get(2, 2))
+      assert.are.same({10, 20, 30}, snapshot:get(2))
+      assert.is_nil(snapshot:get(1, 'missing'))
+      assert.is_nil(snapshot:get(2, 4))
+      assert.has_error(function() snapshot:get(1, {}) end)
+      assert.are.equal('v1', snapshot:get(1, 'version'))
+   end)
+
+   it('Load missing file', function()
+      local ret, err = dbus.load('/nonexistent/snapshot', 's')
+      assert.is_nil(ret)
+      assert.is_truthy(err)
+   end)
+end)
@@ -5,6 +5,7 @@ require 'busted.runner'()
 local dbus = require 'easydbus'
 
 local pack = table.pack or dbus.pack
+local unpack = unpack or table.unpack
 
 local bus_name = 'session'
 local service_name = 'spec.easydbus'
@@ -13,6 +14,18 @@ local interface_name = 'spec.easydbus'
 
 describe('Get ' .. bus_name .. ' bus', function()
    local bus = assert(dbus[bus_name]())
+
+   it('Inside mainloop', function()
+      local ret
+      dbus.add_callback(function()
+         ret = dbus[bus_name]()
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_not_nil(ret)
+      assert.are.equal(0, ret:memory().names)
+   end)
 end)
 
 describe('Service creation', function()
@@ -59,6 +72,661 @@ describe('Service creation', function()
    end)
 end)
 
+describe('Bus object lifecycle', function()
+   it('Memory report', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('dummy', '', '', function() end)
+      local object_id = assert(bus:register_object(object))
+      local sub_id = bus:subscribe(nil, object_path, interface_name, 'DummySignal', function() end)
+
+      local mem = bus:memory()
+      assert.are.equal(1, mem.objects)
+      assert.are.equal(1, mem.subscriptions)
+      assert.are.equal(1, mem.names)
+      assert.are.equal(0, mem.pending_calls)
+
+      bus:unsubscribe(sub_id)
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+
+      mem = bus:memory()
+      assert.are.equal(0, mem.objects)
+      assert.are.equal(0, mem.subscriptions)
+      assert.are.equal(0, mem.names)
+   end)
+
+   it('Shared connection has one bus object', function()
+      local bus = assert(dbus[bus_name]())
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('dummy', '', '', function() end)
+      local object_id = assert(bus:register_object(object))
+
+      assert.are.equal(bus, dbus[bus_name]())
+      collectgarbage()
+      assert.are.equal(1, dbus[bus_name]():memory().objects)
+
+      assert.is_true(bus:unregister_object(object_id))
+   end)
+
+   it('Bus object with registrations is kept alive', function()
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('dummy', '', '', function() end)
+      local object_id = assert(dbus[bus_name]():register_object(object))
+
+      collectgarbage()
+      collectgarbage()
+      assert.are.equal(1, dbus[bus_name]():memory().objects)
+
+      assert.is_true(dbus[bus_name]():unregister_object(object_id))
+   end)
+
+   it('Close releases registrations', function()
+      local bus = assert(dbus[bus_name]())
+      assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('dummy', '', '', function() end)
+      assert(bus:register_object(object))
+      bus:close()
+
+      assert.has_error(function()
+         bus:own_name(service_name)
+      end)
+
+      bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object_id = assert(bus:register_object(object))
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Method statistics', function()
+   it('Count calls and errors', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 's', 's', function(s) return s end)
+      object:add_method('fail', '', '', function() error('failure') end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret, err
+      dbus.add_callback(function()
+         bus:call(service_name, object_path, interface_name, 'echo', 's', 'stats')
+         ret, err = bus:call(service_name, object_path, interface_name, 'fail')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_nil(ret)
+      assert.is_string(err)
+
+      local stats = bus:stats()
+      local echo = stats.client[interface_name .. '.echo']
+      assert.are.equal(1, echo.calls)
+      assert.are.equal(0, echo.errors)
+      assert.are.equal(0, echo.in_flight)
+      assert.are.equal(1, stats.server[interface_name .. '.echo'].calls)
+      assert.are.equal(1, stats.client[interface_name .. '.fail'].errors)
+      assert.are.equal(1, stats.server[interface_name .. '.fail'].errors)
+
+      local n = 0
+      for _,count in pairs(echo.histogram) do
+         n = n + count
+      end
+      assert.are.equal(1, n)
+
+      bus:reset_stats()
+      assert.are.equal(0, bus:stats().client[interface_name .. '.echo'].calls)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Trace', function()
+   it('Record call events', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('traced', '', '', function() end)
+      local object_id = assert(bus:register_object(object))
+
+      dbus.trace(true)
+      dbus.add_callback(function()
+         bus:call(service_name, object_path, interface_name, 'traced')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      local events = {}
+      local serial
+      for _,event in ipairs(dbus.trace_dump()) do
+         if event.member == 'traced' then
+            events[#events+1] = event.type
+            serial = serial or event.serial
+            assert.are.equal(serial, event.serial)
+         end
+      end
+      assert.are.same({'call', 'method', 'method_return', 'call_reply'}, events)
+      dbus.trace(false)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Capture', function()
+   it('Write messages to pcapng file', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 's', 's', function(s) return s end)
+      local object_id = assert(bus:register_object(object))
+      local path = os.tmpname()
+
+      assert.is_true(bus:capture_start(path))
+      assert.is_nil(bus:capture_start(path))
+      dbus.add_callback(function()
+         bus:call(service_name, object_path, interface_name, 'echo', 's', 'captured')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      -- call and reply, both seen as outgoing and incoming
+      assert.is_true(bus:capture_stop() >= 4)
+      assert.is_nil(bus:capture_stop())
+
+      local file = assert(io.open(path, 'rb'))
+      local data = file:read('*a')
+      file:close()
+      os.remove(path)
+
+      assert.are.equal('\10\13\13\10', data:sub(1, 4))
+      assert.is_not_nil(data:find('captured', 1, true))
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Replay captured call', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      local handler = spy.new(function(s) return s end)
+      object:add_method('echo', 's', 's', handler)
+      local object_id = assert(bus:register_object(object))
+      local path = os.tmpname()
+
+      assert(bus:capture_start(path))
+      dbus.add_callback(function()
+         bus:call(service_name, object_path, interface_name, 'echo', 's', 'replayed')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      bus:capture_stop()
+
+      local file = assert(io.open(path, 'rb'))
+      local data = file:read('*a')
+      file:close()
+      os.remove(path)
+
+      -- find outgoing (epb_flags 2) call in little endian pcapng
+      local function uint32(pos)
+         local b1, b2, b3, b4 = data:byte(pos, pos + 3)
+         return b1 + b2 * 0x100 + b3 * 0x10000 + b4 * 0x1000000
+      end
+      local blob, info
+      local pos = 1
+      while pos < #data do
+         if uint32(pos) == 6 then
+            local len = uint32(pos + 20)
+            blob = data:sub(pos + 28, pos + 27 + len)
+            info = assert(dbus.message_info(blob))
+            if info.type == 'method_call' and uint32(pos + 28 + len + (4 - len % 4) % 4 + 4) == 2 then
+               break
+            end
+         end
+         pos = pos + uint32(pos + 4)
+      end
+      assert.are.equal('echo', info.member)
+      assert.are.equal(service_name, info.destination)
+
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call_blob(blob)
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.is_true(ret)
+      assert.spy(handler).was.called(2)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Marshalling statistics', function()
+   it('Count encoded and decoded data', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 'ai', 'ai', function(a) return a end)
+      local object_id = assert(bus:register_object(object))
+
+      dbus.reset_marshal_stats()
+      dbus.set_marshal_stats(true)
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call(service_name, object_path, interface_name, 'echo', 'ai', {1, 2, 3})
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      dbus.set_marshal_stats(false)
+
+      assert.are.same({1, 2, 3}, ret)
+
+      local stats = dbus.marshal_stats()
+      -- request and reply are encoded and decoded once each
+      assert.are.equal(2, stats.encode.calls)
+      assert.are.equal(2, stats.decode.calls)
+      assert.are.equal(2, stats.encode.signatures['(ai)'].calls)
+      assert.are.equal(2, stats.decode.signatures['(ai)'].calls)
+      assert.is_true(stats.encode.bytes > 0)
+      assert.are.equal(2, stats.tables)
+      assert.is_true(stats.variants >= 2)
+
+      dbus.reset_marshal_stats()
+      assert.are.equal(0, dbus.marshal_stats().encode.calls)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Large payloads', function()
+   it('Pass sealed memfd', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('checksum', 'h', 'us', function(fd)
+         local buffer = assert(dbus.mmap(fd))
+         dbus.close(fd)
+         return #buffer, buffer:tostring(-4)
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local data = string.rep('0123456789', 100000) .. 'tail'
+      local fd = assert(dbus.memfd(data))
+      local ret
+      dbus.add_callback(function()
+         ret = pack(bus:call(service_name, object_path, interface_name, 'checksum', 'h', fd))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      dbus.close(fd)
+
+      assert.are.same(pack(#data, 'tail'), ret)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Refuse unsealed fd', function()
+      -- stdin is not a memfd
+      local buffer, err = dbus.mmap(0)
+      assert.is_nil(buffer)
+      assert.is_string(err)
+   end)
+end)
+
+describe('JSON calls', function()
+   it('Call with JSON parameters and reply', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 'a{sv}x', 'a{sv}x', function(d, x) return d, x end)
+      local object_id = assert(bus:register_object(object))
+
+      local ret
+      dbus.add_callback(function()
+         ret = bus:call_json(service_name, object_path, interface_name, 'echo', 'a{sv}x',
+                             '[{"name": "a\\"b", "list": [1, 2.5]}, 9007199254740993]')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      local d, x = dbus.from_json('a{sv}x', ret)
+      assert.are.same({name = 'a"b', list = {1, 2.5}}, d)
+      assert.are.equal(9007199254740993, x)
+      assert.is_truthy(ret:find('9007199254740993', 1, true))
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Convert values', function()
+      assert.are.equal('["a",[1,2],{"3":true}]', dbus.to_json('sai{ub}', 'a', {1, 2}, {[3] = true}))
+      assert.are.same({'a', {1, 2}, {[3] = true}}, {dbus.from_json('sai{ub}', '["a", [1, 2], {"3": true}]')})
+      assert.are.equal('[]', dbus.to_json(''))
+      assert.are.same({{[1] = 'x'}}, {dbus.from_json('a{is}', '[{"1":"x"}]')})
+   end)
+
+   it('Invalid JSON', function()
+      local ret, err = dbus.from_json('i', '["a"]')
+      assert.is_nil(ret)
+      assert.is_truthy(err:find('Invalid JSON'))
+      assert.is_nil(dbus.from_json('y', '[256]'))
+      assert.is_nil(dbus.from_json('ii', '[1]'))
+      assert.is_nil(dbus.from_json('i', '[1] x'))
+
+      local ok, deep = dbus.from_json('v', '[' .. string.rep('[', 100) .. string.rep(']', 100) .. ']')
+      assert.is_nil(ok)
+      assert.is_truthy(deep:find('nesting too deep'))
+   end)
+end)
+
+describe('Reply cache', function()
+   it('Serve cached replies until invalidated', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local counter = 0
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('count', 's', 'si', function(s)
+         counter = counter + 1
+         return s, counter
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local proxy = bus:new_proxy(service_name, object_path)
+      proxy:add_method('count', interface_name, 's', {invalidate = 'Changed'})
+
+      local ret = {}
+      dbus.add_callback(function()
+         ret[1] = pack(proxy:count('a'))
+         ret[2] = pack(proxy:count('a'))
+         ret[3] = pack(proxy:count('b'))
+         proxy:invalidate('count')
+         ret[4] = pack(proxy:count('a'))
+         bus:emit(nil, object_path, interface_name, 'Changed')
+         dbus.add_timeout(100, function()
+            ret[5] = pack(proxy:count('a'))
+            dbus.mainloop_quit()
+         end)
+      end)
+      dbus.mainloop()
+
+      assert.are.same(pack('a', 1), ret[1])
+      assert.are.same(pack('a', 1), ret[2])
+      assert.are.same(pack('b', 2), ret[3])
+      assert.are.same(pack('a', 3), ret[4])
+      assert.are.same(pack('a', 4), ret[5])
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Expire cached replies', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local counter = 0
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('count', '', 'i', function()
+         counter = counter + 1
+         return counter
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local proxy = bus:new_proxy(service_name, object_path)
+      proxy:add_method('count', interface_name, '', {ttl = 0.05})
+
+      local ret = {}
+      dbus.add_callback(function()
+         ret[1] = proxy:count()
+         ret[2] = proxy:count()
+         dbus.add_timeout(100, function()
+            ret[3] = proxy:count()
+            dbus.mainloop_quit()
+         end)
+      end)
+      dbus.mainloop()
+
+      assert.are.same({1, 1, 2}, ret)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Copy cached replies, limit their number', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local counter = 0
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('list', 's', 'as', function(s)
+         counter = counter + 1
+         return {s}
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      local proxy = bus:new_proxy(service_name, object_path)
+      proxy:add_method('list', interface_name, 's', {max_size = 1})
+
+      local ret = {}
+      dbus.add_callback(function()
+         proxy:list('a')[1] = 'changed'
+         ret[1] = proxy:list('a')
+         proxy:list('b')
+         ret[2] = proxy:list('a')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.are.same({'a'}, ret[1])
+      assert.are.same({'a'}, ret[2])
+      assert.are.equal(3, counter)
+
+      -- oldest entry is evicted first
+      proxy:add_method('list', interface_name, 's', {max_size = 2})
+      counter = 0
+      dbus.add_callback(function()
+         proxy:list('a')
+         proxy:list('b')
+         proxy:list('c')
+         proxy:list('b')
+         proxy:list('c')
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      assert.are.equal(3, counter)
+
+      proxy:close()
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Coalesced calls', function()
+   it('Send identical calls in flight once', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local counter = 0
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('count', 's', 'si', function(s)
+         counter = counter + 1
+         return s, counter
+      end)
+      local object_id = assert(bus:register_object(object))
+
+      bus:coalesce(interface_name, 'count')
+
+      local ret, n = {}, 0
+      local function call(i, s)
+         ret[i] = pack(bus:call(service_name, object_path, interface_name, 'count', 's', s))
+         n = n + 1
+         if n == 4 then
+            dbus.mainloop_quit()
+         end
+      end
+      dbus.add_callback(call, 1, 'a')
+      dbus.add_callback(call, 2, 'a')
+      dbus.add_callback(call, 3, 'b')
+      dbus.add_callback(call, 4, 'a')
+      dbus.mainloop()
+
+      assert.are.equal(2, counter)
+      assert.are.same(ret[1], ret[2])
+      assert.are.same(ret[1], ret[4])
+      assert.are_not.same(ret[1], ret[3])
+
+      bus:coalesce(interface_name, 'count', false)
+
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+end)
+
+describe('Name owner tracking', function()
+   it('Watch name', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local events = {}
+      local id = bus:watch_name(service_name, function(tag, name, owner)
+         events[#events + 1] = {tag, 'appeared', name, owner}
+         bus:unown_name(owner_id)
+      end, function(tag, name)
+         events[#events + 1] = {tag, 'vanished', name}
+         dbus.mainloop_quit()
+      end, 'tag')
+      dbus.mainloop()
+      bus:unwatch_name(id)
+
+      assert.are.equal(2, #events)
+      assert.are.same({'tag', 'appeared', service_name}, {unpack(events[1], 1, 3)})
+      assert.is_truthy(events[1][4]:match('^:'))
+      assert.are.same({'tag', 'vanished', service_name}, events[2])
+   end)
+
+   it('Route calls to unique name', function()
+      local bus = assert(dbus[bus_name]())
+      local owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 's', 's', function(s) return s end)
+      local object_id = assert(bus:register_object(object))
+
+      local proxy = bus:new_proxy(service_name, object_path, {route = true})
+      proxy:add_method('echo', interface_name, 's')
+
+      local ret, ret2, err
+      dbus.add_timeout(100, function()
+         ret = proxy:echo('hello')
+         bus:unown_name(owner_id)
+         dbus.add_timeout(100, function()
+            ret2, err = proxy:echo('hello')
+            dbus.mainloop_quit()
+         end)
+      end)
+      dbus.mainloop()
+      bus:unroute(service_name)
+
+      assert.are.equal('hello', ret)
+      assert.is_nil(ret2)
+      assert.is_truthy(err:find('has no owner'))
+
+      assert.is_true(bus:unregister_object(object_id))
+   end)
+end)
+
+describe('Private connections', function()
+   local bus
+   local owner_id
+   local object_id
+
+   before_each(function()
+      bus = assert(dbus[bus_name]())
+      owner_id = assert(bus:own_name(service_name))
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 's', 's', function(s) return s end)
+      object_id = assert(bus:register_object(object))
+   end)
+
+   after_each(function()
+      assert.is_true(bus:unregister_object(object_id))
+      bus:unown_name(owner_id)
+   end)
+
+   it('Call through private connection', function()
+      local conn = assert(dbus.connect(bus_name))
+
+      local ret
+      dbus.add_callback(function()
+         ret = pack(conn:call(service_name, object_path, interface_name, 'echo', 's', 'private'))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.are.same(pack('private'), ret)
+   end)
+
+   it('Call through connection pool', function()
+      local pool = assert(dbus.pool(bus_name, 3))
+      assert.are_not.equal(pool:get(), pool:get())
+
+      local ret = {}
+      dbus.add_callback(function()
+         for i = 1, 4 do
+            ret[i] = pool:call(service_name, object_path, interface_name, 'echo', 's', tostring(i))
+         end
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.are.same({'1', '2', '3', '4'}, ret)
+   end)
+
+   it('Invalid address', function()
+      local conn, err = dbus.connect('invalid:address')
+      assert.is_nil(conn)
+      assert.is_string(err)
+   end)
+
+   it('Connect inside mainloop', function()
+      local ret
+      dbus.add_callback(function()
+         local conn = assert(dbus.connect(bus_name))
+         ret = pack(conn:call(service_name, object_path, interface_name, 'echo', 's', 'async'))
+         conn:close()
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+
+      assert.are.same(pack('async'), ret)
+   end)
+end)
+
+describe('Peer to peer connections', function()
+   it('Call method over peer connection', function()
+      local object = dbus.object(object_path, interface_name)
+      object:add_method('echo', 's', 's', function(s) return s end)
+      local server = assert(dbus.server('unix:tmpdir=/tmp', function(conn)
+         assert(conn:register_object(object))
+      end))
+
+      local ret
+      dbus.add_callback(function()
+         local conn = assert(dbus.connect(server:address(), {bus = false}))
+         ret = pack(conn:call(nil, object_path, interface_name, 'echo', 's', 'peer'))
+         conn:close()
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      server:stop()
+
+      assert.are.same(pack('peer'), ret)
+   end)
+end)
+
 describe('Method handlers return values', function()
    local bus
    local owner_id
@@ -307,4 +975,18 @@ describe('Invalid service creation', function()
          assert(bus:own_name(service_name))
       end)
    end)
+
+   it('Own taken name inside mainloop', function()
+      local conn = assert(dbus.connect(bus_name))
+      local ret
+      dbus.add_callback(function()
+         ret = pack(conn:own_name(service_name))
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      conn:close()
+
+      -- not queued for the name, fails right away
+      assert.are.same(pack(false), ret)
+   end)
 end)
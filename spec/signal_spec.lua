@@ -65,3 +65,43 @@ describe('Wrong subscribe usage', function()
       bus:unown_name(owner_id)
    end)
 end)
+
+describe('Outgoing queue', function()
+   it('Flush and gauge queue', function()
+      local bus = assert(dbus[bus_name]())
+      for _ = 1, 10 do
+         assert.is_true(bus:emit(nil, object_path, interface_name, 'DummySignal', 's', 'payload'))
+      end
+      assert.is_true(bus:flush())
+
+      local stats = bus:queue_stats()
+      assert.are.equal(0, stats.messages)
+      assert.are.equal(0, stats.bytes)
+      assert.is_true(stats.max_messages <= 10)
+   end)
+
+   it('Flush inside mainloop', function()
+      local bus = assert(dbus[bus_name]())
+      local ret
+      dbus.add_callback(function()
+         bus:emit(nil, object_path, interface_name, 'DummySignal')
+         ret = bus:flush()
+         dbus.mainloop_quit()
+      end)
+      dbus.mainloop()
+      assert.is_true(ret)
+   end)
+
+   it('Wait at high water mark', function()
+      local bus = assert(dbus[bus_name]())
+      bus:set_high_water(nil, 1, true)
+      for _ = 1, 100 do
+         assert.is_true(bus:emit(nil, object_path, interface_name, 'DummySignal', 's', 'payload'))
+      end
+      local stats = bus:queue_stats()
+      assert.is_true(stats.max_messages <= 1)
+      assert.are.equal(1, stats.high_water_messages)
+      assert.is_true(stats.wait)
+      bus:set_high_water()
+   end)
+end)
@@ -0,0 +1,692 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include "buffer.h"
+
+#include "compat.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#include <linux/memfd.h>
+#include <sys/syscall.h>
+
+static int memfd_create(const char *name, unsigned int flags)
+{
+    return syscall(SYS_memfd_create, name, flags);
+}
+#endif
+
+/* Seals which guarantee that mapped memfd will not change under us */
+#define MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+static int buffer_mt;
+#define BUFFER_MT ((void *) &buffer_mt)
+
+/* Convert arrays to buffers in push_variant() */
+gboolean buffer_arrays = FALSE;
+
+static const char *const buffer_types[] = {"u8", "i32", "f64", NULL};
+static const gsize buffer_type_size[] = {1, 4, 8};
+static const char buffer_type_sig[] = {'y', 'i', 'd'};
+
+static struct buffer_storage *storage_new(enum buffer_storage_kind kind, gsize size)
+{
+    struct buffer_storage *storage = g_new(struct buffer_storage, 1);
+
+    storage->ref = 1;
+    storage->kind = kind;
+    storage->data = (kind == STORAGE_OWNED && size) ? g_malloc0(size) : NULL;
+    storage->size = size;
+    storage->variant = NULL;
+
+    return storage;
+}
+
+static struct buffer_storage *storage_ref(struct buffer_storage *storage)
+{
+    g_atomic_int_inc(&storage->ref);
+    return storage;
+}
+
+static void storage_unref(gpointer data)
+{
+    struct buffer_storage *storage = data;
+
+    if (!g_atomic_int_dec_and_test(&storage->ref))
+        return;
+
+    switch (storage->kind) {
+    case STORAGE_OWNED:
+        g_free(storage->data);
+        break;
+    case STORAGE_MAPPED:
+        if (storage->size)
+            munmap(storage->data, storage->size);
+        break;
+    case STORAGE_VARIANT:
+        g_variant_unref(storage->variant);
+        break;
+    }
+
+    g_free(storage);
+}
+
+/* Returns NULL if value at index is not a buffer */
+struct easydbus_buffer *test_buffer(lua_State *L, int index)
+{
+    struct easydbus_buffer *buffer = lua_touserdata(L, index);
+    int is_buffer = 0;
+
+    if (buffer && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, BUFFER_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        is_buffer = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+
+    return is_buffer ? buffer : NULL;
+}
+
+static struct easydbus_buffer *check_buffer(lua_State *L, int index)
+{
+    struct easydbus_buffer *buffer = test_buffer(L, index);
+
+    luaL_argcheck(L, buffer != NULL, index, "buffer expected");
+
+    return buffer;
+}
+
+/* Views are clamped, as storage might have been shrunk meanwhile */
+guchar *buffer_data(struct easydbus_buffer *buffer, gsize *size)
+{
+    struct buffer_storage *storage = buffer->storage;
+    gsize avail = storage->size > buffer->offset ? storage->size - buffer->offset : 0;
+
+    *size = buffer->whole ? avail : MIN(buffer->length, avail);
+
+    return storage->data + buffer->offset;
+}
+
+static gsize buffer_n_elements(struct easydbus_buffer *buffer)
+{
+    gsize size;
+
+    buffer_data(buffer, &size);
+
+    return size / buffer_type_size[buffer->type];
+}
+
+/* Takes ownership of storage reference */
+static struct easydbus_buffer *push_buffer(lua_State *L, struct buffer_storage *storage, enum buffer_type type)
+{
+    struct easydbus_buffer *buffer = lua_newuserdata(L, sizeof(*buffer));
+
+    buffer->storage = storage;
+    buffer->type = type;
+    buffer->offset = 0;
+    buffer->length = 0;
+    buffer->whole = TRUE;
+
+    lua_pushlightuserdata(L, BUFFER_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return buffer;
+}
+
+static void push_view(lua_State *L, struct easydbus_buffer *buffer, enum buffer_type type,
+                      gsize offset, gsize length, gboolean whole)
+{
+    struct easydbus_buffer *view = push_buffer(L, storage_ref(buffer->storage), type);
+
+    view->offset = offset;
+    view->length = length;
+    view->whole = whole;
+}
+
+static lua_Number get_element(guchar *data, enum buffer_type type)
+{
+    gint32 i32;
+    gdouble f64;
+
+    switch (type) {
+    case BUFFER_I32:
+        memcpy(&i32, data, sizeof(i32));
+        return i32;
+    case BUFFER_F64:
+        memcpy(&f64, data, sizeof(f64));
+        return f64;
+    default:
+        return *data;
+    }
+}
+
+static void set_element(guchar *data, enum buffer_type type, lua_Number value)
+{
+    gint32 i32;
+    gdouble f64;
+
+    switch (type) {
+    case BUFFER_I32:
+        i32 = (gint32) value;
+        memcpy(data, &i32, sizeof(i32));
+        break;
+    case BUFFER_F64:
+        f64 = value;
+        memcpy(data, &f64, sizeof(f64));
+        break;
+    default:
+        *data = (guchar) value;
+    }
+}
+
+static void push_element(lua_State *L, guchar *data, enum buffer_type type)
+{
+    if (type == BUFFER_F64)
+        lua_pushnumber(L, get_element(data, type));
+    else
+        lua_pushinteger(L, (lua_Integer) get_element(data, type));
+}
+
+/*
+ * Creates buffer:
+ * dbus.buffer(n[, type])       n zeroed elements
+ * dbus.buffer(string[, type])  copy of string bytes
+ * dbus.buffer(table[, type])   array of numbers
+ */
+static int buffer_new(lua_State *L)
+{
+    enum buffer_type type;
+    gsize elem_size;
+    struct buffer_storage *storage;
+    lua_Integer count;
+    size_t len;
+    gsize i, n;
+
+    /* Drop buffer table itself (__call), so errors report caller's argument numbers */
+    lua_remove(L, 1);
+
+    type = luaL_checkoption(L, 2, "u8", buffer_types);
+    elem_size = buffer_type_size[type];
+
+    switch (lua_type(L, 1)) {
+    case LUA_TNUMBER:
+        count = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, count >= 0, 1, "negative size");
+        luaL_argcheck(L, (guint64) count <= G_MAXSIZE / elem_size, 1, "size too large");
+        push_buffer(L, storage_new(STORAGE_OWNED, count * elem_size), type);
+        break;
+    case LUA_TSTRING:
+    {
+        const char *str = lua_tolstring(L, 1, &len);
+
+        storage = storage_new(STORAGE_OWNED, len - len % elem_size);
+        memcpy(storage->data, str, storage->size);
+        push_buffer(L, storage, type);
+        break;
+    }
+    case LUA_TTABLE:
+        n = lua_rawlen(L, 1);
+        luaL_argcheck(L, n <= G_MAXSIZE / elem_size, 1, "table too large");
+        storage = storage_new(STORAGE_OWNED, n * elem_size);
+        push_buffer(L, storage, type);
+        for (i = 0; i < n; i++) {
+            lua_rawgeti(L, 1, i + 1);
+            if (lua_type(L, -1) != LUA_TNUMBER)
+                return luaL_argerror(L, 1, lua_pushfstring(L, "number expected at index %d, got %s",
+                                                           (int) i + 1, luaL_typename(L, -1)));
+            set_element(storage->data + i * elem_size, type, lua_tonumber(L, -1));
+            lua_pop(L, 1);
+        }
+        break;
+    default:
+        return luaL_argerror(L, 1, "number, string or table expected");
+    }
+
+    return 1;
+}
+
+static int buffer__gc(lua_State *L)
+{
+    struct easydbus_buffer *buffer = lua_touserdata(L, 1);
+
+    if (buffer->storage) {
+        storage_unref(buffer->storage);
+        buffer->storage = NULL;
+    }
+
+    return 0;
+}
+
+/* Number of elements */
+static int buffer__len(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+
+    lua_pushinteger(L, buffer_n_elements(buffer));
+    return 1;
+}
+
+/* buffer[i] returns i-th element, other keys are looked up in methods */
+static int buffer__index(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+    gsize elem_size = buffer_type_size[buffer->type];
+    gsize size;
+    guchar *data;
+    lua_Integer i;
+
+    if (lua_type(L, 2) != LUA_TNUMBER) {
+        lua_pushlightuserdata(L, BUFFER_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        return 1;
+    }
+
+    data = buffer_data(buffer, &size);
+    i = lua_tointeger(L, 2);
+    if (i < 1 || (gsize) i > size / elem_size)
+        return 0;
+
+    push_element(L, data + (i - 1) * elem_size, buffer->type);
+    return 1;
+}
+
+static int buffer__newindex(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+    gsize elem_size = buffer_type_size[buffer->type];
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Number value = luaL_checknumber(L, 3);
+    gsize size;
+    guchar *data = buffer_data(buffer, &size);
+
+    luaL_argcheck(L, buffer->storage->kind == STORAGE_OWNED, 1, "buffer is read-only");
+    luaL_argcheck(L, i >= 1 && (gsize) i <= size / elem_size, 2, "index out of range");
+
+    set_element(data + (i - 1) * elem_size, buffer->type, value);
+    return 0;
+}
+
+/* Converts Lua string.sub() like range into first element and count */
+static void check_range(lua_State *L, int index, gsize n, gsize *first, gsize *count)
+{
+    lua_Integer i = luaL_optinteger(L, index, 1);
+    lua_Integer j = luaL_optinteger(L, index + 1, -1);
+
+    if (i < 0)
+        i += n + 1;
+    if (j < 0)
+        j += n + 1;
+    if (i < 1)
+        i = 1;
+    if (j > (lua_Integer) n)
+        j = n;
+
+    *first = i - 1;
+    *count = j >= i ? (gsize) (j - i + 1) : 0;
+}
+
+/* Copies elements i..j into Lua string (raw bytes) */
+static int buffer_tostring(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+    gsize elem_size = buffer_type_size[buffer->type];
+    gsize size, first, count;
+    guchar *data = buffer_data(buffer, &size);
+
+    check_range(L, 2, size / elem_size, &first, &count);
+    lua_pushlstring(L, (const char *) data + first * elem_size, count * elem_size);
+    return 1;
+}
+
+/* Copies elements i..j into Lua table */
+static int buffer_totable(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+    gsize elem_size = buffer_type_size[buffer->type];
+    gsize size, first, count, i;
+    guchar *data = buffer_data(buffer, &size);
+
+    check_range(L, 2, size / elem_size, &first, &count);
+    data += first * elem_size;
+
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; i++) {
+        push_element(L, data + i * elem_size, buffer->type);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+/* Returns view of elements i..j, sharing memory with buffer */
+static int buffer_slice(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+    gsize elem_size = buffer_type_size[buffer->type];
+    gsize first, count;
+
+    check_range(L, 2, buffer_n_elements(buffer), &first, &count);
+    push_view(L, buffer, buffer->type, buffer->offset + first * elem_size, count * elem_size, FALSE);
+    return 1;
+}
+
+/* Returns view of the same memory as array of other type */
+static int buffer_view(lua_State *L, enum buffer_type type)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+
+    push_view(L, buffer, type, buffer->offset, buffer->length, buffer->whole);
+    return 1;
+}
+
+static int buffer_u8(lua_State *L)
+{
+    return buffer_view(L, BUFFER_U8);
+}
+
+static int buffer_i32(lua_State *L)
+{
+    return buffer_view(L, BUFFER_I32);
+}
+
+static int buffer_f64(lua_State *L)
+{
+    return buffer_view(L, BUFFER_F64);
+}
+
+static int buffer_type(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+
+    lua_pushstring(L, buffer_types[buffer->type]);
+    return 1;
+}
+
+/* Resizes buffer to n elements, new ones are zeroed */
+static int buffer_resize(lua_State *L)
+{
+    struct easydbus_buffer *buffer = check_buffer(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    struct buffer_storage *storage = buffer->storage;
+    gsize size;
+
+    luaL_argcheck(L, storage->kind == STORAGE_OWNED, 1, "buffer is read-only");
+    luaL_argcheck(L, buffer->whole, 1, "slices can't be resized");
+    luaL_argcheck(L, n >= 0, 2, "negative size");
+    luaL_argcheck(L, (guint64) n <= (G_MAXSIZE - buffer->offset) / buffer_type_size[buffer->type], 2,
+                  "size too large");
+
+    size = buffer->offset + n * buffer_type_size[buffer->type];
+    storage->data = g_realloc(storage->data, size);
+    if (size > storage->size)
+        memset(storage->data + storage->size, 0, size - storage->size);
+    storage->size = size;
+
+    return 0;
+}
+
+/*
+ * Converts buffer to 'ay', 'ai' or 'ad' array (or guesses it from buffer
+ * type, when sig is NULL). Read-only memory is shared with the GVariant,
+ * writable one is copied, so later changes to buffer are not sent.
+ */
+GVariant *buffer_to_variant(lua_State *L, struct easydbus_buffer *buffer, const char *sig)
+{
+    char elem_sig = sig ? sig[1] : buffer_type_sig[buffer->type];
+    gsize size;
+    guchar *data = buffer_data(buffer, &size);
+    gsize elem_size;
+    const GVariantType *type;
+    const GVariantType *elem_type;
+
+    switch (elem_sig) {
+    case 'y':
+        elem_size = 1;
+        type = G_VARIANT_TYPE_BYTESTRING;
+        elem_type = G_VARIANT_TYPE_BYTE;
+        break;
+    case 'i':
+        elem_size = 4;
+        type = G_VARIANT_TYPE("ai");
+        elem_type = G_VARIANT_TYPE_INT32;
+        break;
+    case 'd':
+        elem_size = 8;
+        type = G_VARIANT_TYPE("ad");
+        elem_type = G_VARIANT_TYPE_DOUBLE;
+        break;
+    default:
+        luaL_error(L, "Buffer can't be converted to %s", sig);
+        return NULL;
+    }
+
+    size -= size % elem_size;
+
+    if (buffer->storage->kind != STORAGE_OWNED && ((gsize) data % elem_size) == 0)
+        return g_variant_new_from_data(type, data, size, TRUE, storage_unref, storage_ref(buffer->storage));
+
+    return g_variant_new_fixed_array(elem_type, data, size / elem_size, elem_size);
+}
+
+/* Lua string as 'ay' */
+GVariant *string_to_bytes_variant(lua_State *L, int index)
+{
+    size_t len;
+    const char *str = lua_tolstring(L, index, &len);
+
+    return g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, str, len, 1);
+}
+
+/*
+ * Pushes 'ay', 'ai' or 'ad' array as read-only buffer referencing value,
+ * without copying. Returns 0 for other types.
+ */
+int push_array_buffer(lua_State *L, GVariant *value)
+{
+    struct buffer_storage *storage;
+    enum buffer_type type;
+    gsize n;
+
+    switch (g_variant_get_type_string(value)[1]) {
+    case 'y':
+        type = BUFFER_U8;
+        break;
+    case 'i':
+        type = BUFFER_I32;
+        break;
+    case 'd':
+        type = BUFFER_F64;
+        break;
+    default:
+        return 0;
+    }
+
+    storage = storage_new(STORAGE_VARIANT, 0);
+    storage->variant = g_variant_ref_sink(value);
+    storage->data = (guchar *) g_variant_get_fixed_array(value, &n, buffer_type_size[type]);
+    storage->size = n * buffer_type_size[type];
+    push_buffer(L, storage, type);
+
+    return 1;
+}
+
+static int easydbus_buffer_arrays(lua_State *L)
+{
+    buffer_arrays = lua_toboolean(L, 1);
+    return 0;
+}
+
+/*
+ * Creates sealed memfd with given data. Returned fd can be passed as 'h'
+ * argument and has to be closed with dbus.close() afterwards.
+ */
+static int easydbus_memfd(lua_State *L)
+{
+    struct easydbus_buffer *buffer = test_buffer(L, 1);
+    const char *name = luaL_optstring(L, 2, "easydbus");
+    const char *data;
+    size_t size;
+    int fd;
+
+    if (buffer) {
+        gsize buffer_size;
+
+        data = (const char *) buffer_data(buffer, &buffer_size);
+        size = buffer_size;
+    } else {
+        data = luaL_checklstring(L, 1, &size);
+    }
+
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        goto err;
+
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            goto err_close;
+        }
+        data += n;
+        size -= n;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, MEMFD_SEALS) < 0)
+        goto err_close;
+
+    lua_pushinteger(L, fd);
+    return 1;
+
+err_close:
+    {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+    }
+err:
+    lua_pushnil(L);
+    lua_pushfstring(L, "Failed to create memfd: %s", g_strerror(errno));
+    return 2;
+}
+
+/*
+ * Maps sealed memfd read-only into buffer, without copying. Fd can be closed
+ * right afterwards.
+ */
+static int easydbus_mmap(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    enum buffer_type type = luaL_checkoption(L, 2, "u8", buffer_types);
+    struct buffer_storage *storage;
+    struct stat st;
+    int seals;
+    void *data;
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Not a sealed memfd");
+        return 2;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Failed to stat fd: %s", g_strerror(errno));
+        return 2;
+    }
+
+    data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "Failed to mmap fd: %s", g_strerror(errno));
+            return 2;
+        }
+    }
+
+    storage = storage_new(STORAGE_MAPPED, st.st_size);
+    storage->data = data;
+    push_buffer(L, storage, type);
+
+    return 1;
+}
+
+static int easydbus_close(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+
+    if (close(fd) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, g_strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static luaL_Reg buffer_funcs[] = {
+    {"tostring", buffer_tostring},
+    {"totable", buffer_totable},
+    {"slice", buffer_slice},
+    {"u8", buffer_u8},
+    {"i32", buffer_i32},
+    {"f64", buffer_f64},
+    {"type", buffer_type},
+    {"resize", buffer_resize},
+    {"__len", buffer__len},
+    {"__index", buffer__index},
+    {"__newindex", buffer__newindex},
+    {"__gc", buffer__gc},
+    {NULL, NULL},
+};
+
+static luaL_Reg module_funcs[] = {
+    {"memfd", easydbus_memfd},
+    {"mmap", easydbus_mmap},
+    {"close", easydbus_close},
+    {"buffer_arrays", easydbus_buffer_arrays},
+    {NULL, NULL},
+};
+
+/*
+ * Adds buffer related functions to module table at index 1 and returns
+ * buffer methods table.
+ */
+int luaopen_easydbus_buffer(lua_State *L)
+{
+    luaL_setfuncs(L, module_funcs, 0);
+
+    /* Set buffer mt, calling it creates new buffer */
+    luaL_newlibtable(L, buffer_funcs);
+    luaL_setfuncs(L, buffer_funcs, 0);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, buffer_new);
+    lua_setfield(L, -2, "__call");
+    lua_setmetatable(L, -2);
+
+    /* Set buffer mt in registry */
+    lua_pushlightuserdata(L, BUFFER_MT);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    return 1;
+}
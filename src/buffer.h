@@ -0,0 +1,53 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+enum buffer_storage_kind {
+    STORAGE_OWNED,   /* g_malloc()ed, writable and resizable */
+    STORAGE_MAPPED,  /* mmap()ed sealed memfd, read-only */
+    STORAGE_VARIANT, /* data of referenced GVariant, read-only */
+};
+
+/* Memory shared by buffer and all its views */
+struct buffer_storage {
+    gint ref;
+    enum buffer_storage_kind kind;
+    guchar *data;
+    gsize size;
+    GVariant *variant;
+};
+
+enum buffer_type {
+    BUFFER_U8,
+    BUFFER_I32,
+    BUFFER_F64,
+};
+
+struct easydbus_buffer {
+    struct buffer_storage *storage;
+    enum buffer_type type;
+    gsize offset;    /* in bytes */
+    gsize length;    /* in bytes, ignored if whole */
+    gboolean whole;  /* spans till end of storage, follows resizes */
+};
+
+struct easydbus_buffer *test_buffer(lua_State *L, int index);
+guchar *buffer_data(struct easydbus_buffer *buffer, gsize *size);
+
+extern gboolean buffer_arrays;
+
+GVariant *buffer_to_variant(lua_State *L, struct easydbus_buffer *buffer, const char *sig);
+GVariant *string_to_bytes_variant(lua_State *L, int index);
+int push_array_buffer(lua_State *L, GVariant *value);
+
+int luaopen_easydbus_buffer(lua_State *L);
@@ -6,80 +6,291 @@
 
 #include "bus.h"
 
+#include "capture.h"
 #include "compat.h"
 #include "easydbus.h"
+#include "json.h"
 #include "poll.h"
+#include "probes.h"
+#include "queue.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
+#include <string.h>
+
 static int bus_mt;
 #define BUS_MT ((void *) &bus_mt)
 
+static int invocation_mt;
+#define INVOCATION_MT ((void *) &invocation_mt)
+
+/* Weak table of bus objects, keyed by GDBusConnection pointer */
+static int bus_cache;
+#define BUS_CACHE ((void *) &bus_cache)
+
+static struct easydbus_conn *check_bus(lua_State *L, int index)
+{
+    struct easydbus_conn *bus = lua_touserdata(L, index);
+    int is_bus = 0;
+
+    if (bus && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, BUS_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        is_bus = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+
+    luaL_argcheck(L, is_bus, index, "bus expected");
+    luaL_argcheck(L, bus->conn != NULL, index, "Connection is closed");
+
+    return bus;
+}
+
 static GDBusConnection *get_conn(lua_State *L, int index)
 {
-    GDBusConnection *conn;
+    return check_bus(L, index)->conn;
+}
 
-    lua_rawgeti(L, index, 1);
+/*
+ * Bus object owning registrations is anchored in registry, so that
+ * dbus.session():own_name(...) keeps the name without holding the handle.
+ * It is released by bus:close() or once everything is dropped.
+ */
+static void bus_anchor(lua_State *L, struct easydbus_conn *bus, int index)
+{
+    gboolean owns = g_hash_table_size(bus->objects) || g_hash_table_size(bus->subscriptions) ||
+        g_hash_table_size(bus->names) || g_hash_table_size(bus->watches);
 
-    conn = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    lua_pushlightuserdata(L, bus);
+    if (owns)
+        lua_pushvalue(L, index);
+    else
+        lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+struct call_ud {
+    lua_State *T;
+    GHashTable *stats_table;
+    struct method_stats *stats;
+    gint64 start_time;
+    guint32 serial;
+    GHashTable *inflight;
+    GBytes *key;
+};
+
+/* Resumes callback with reply and releases thread */
+static void resume_call(lua_State *T, GVariant *result, GUnixFDList *fd_list, GError *error)
+{
+    if (!error) {
+        ed_resume(T, 1 + push_tuple(T, result, fd_list));
+    } else {
+        lua_pushnil(T);
+        lua_pushstring(T, error->message);
+        ed_resume(T, 3);
+    }
 
-    return conn;
+    /* Remove thread from registry, so garbage collection can take place */
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
 }
 
 static void call_callback(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    lua_State *T = user_data;
-    GDBusConnection *conn = lua_touserdata(T, 1);
+    struct call_ud *call_ud = user_data;
+    lua_State *T = call_ud->T;
+    struct easydbus_conn *bus = lua_touserdata(T, 1);
+    GDBusConnection *conn = G_DBUS_CONNECTION(source);
     GError *error = NULL;
     GUnixFDList *fd_list = NULL;
     GVariant *result = g_dbus_connection_call_with_unix_fd_list_finish(conn, &fd_list, res, &error);
-    int i;
-    int n_args = lua_gettop(T);
+    GPtrArray *waiters = NULL;
+    guint i;
 
-    g_debug("call_callback(%p)", (void *) user_data);
+    ed_debug("call_callback(%p)", (void *) T);
 
-    for (i = 1; i <= n_args; i++) {
-        if (lua_type(T, i) == LUA_TSTRING)
-            g_debug("arg %d: %s", i, lua_tostring(T, i));
-        else
-            g_debug("arg %d: type=%s", i, lua_typename(T, lua_type(T, i)));
+    bus->pending_calls--;
+
+    /* Method name is kept at T[5] */
+    trace_event(error ? TRACE_CALL_ERROR : TRACE_CALL_REPLY, call_ud->serial, lua_tostring(T, 5));
+    ED_PROBE4(call_reply, call_ud->serial, lua_tostring(T, 5), call_ud->start_time, error != NULL);
+
+    /* Stats table is referenced, as bus might have been closed meanwhile */
+    stats_end(call_ud->stats, call_ud->start_time, error != NULL);
+    g_hash_table_unref(call_ud->stats_table);
+
+    /* Identical calls made from now on are sent again */
+    if (call_ud->key) {
+        waiters = g_ptr_array_ref(g_hash_table_lookup(call_ud->inflight, call_ud->key));
+        g_hash_table_remove(call_ud->inflight, call_ud->key);
+        g_hash_table_unref(call_ud->inflight);
+        g_bytes_unref(call_ud->key);
     }
+    g_free(call_ud);
 
-    if (!error) {
-        g_debug("got reply");
+    ed_debug_args(T, 1, lua_gettop(T));
 
-        g_assert_no_error(error);
-        g_assert(result != NULL);
+    resume_call(T, result, fd_list, error);
 
-        /* Resume Lua callback */
-        ed_resume(T, 1 + push_tuple(T, result, fd_list));
+    if (waiters) {
+        ed_debug("resuming %u coalesced calls", waiters->len);
+        for (i = 0; i < waiters->len; i++)
+            resume_call(g_ptr_array_index(waiters, i), result, fd_list, error);
+        g_ptr_array_unref(waiters);
+    }
 
-        if (fd_list)
-            g_object_unref(fd_list);
+    if (fd_list)
+        g_object_unref(fd_list);
+    if (result)
         g_variant_unref(result);
-    } else {
-        lua_pushnil(T);
-        lua_pushstring(T, error->message);
-        ed_resume(T, 3);
+    g_clear_error(&error);
+}
 
-        g_clear_error(&error);
+/*
+ * Returns key identifying call of coalesced method, or NULL if it should be
+ * sent on its own.
+ */
+static GBytes *coalesce_key(struct easydbus_conn *bus, const char *bus_name, const char *object_path,
+                            const char *interface_name, const char *method_name, GVariant *params,
+                            GUnixFDList *fd_list)
+{
+    GString *key;
+    gchar *name;
+    gboolean coalesced;
+
+    if (!g_hash_table_size(bus->coalesce) || g_unix_fd_list_get_length(fd_list) > 0)
+        return NULL;
+
+    name = g_strconcat(interface_name, ".", method_name, NULL);
+    coalesced = g_hash_table_contains(bus->coalesce, name);
+    g_free(name);
+    if (!coalesced)
+        return NULL;
+
+    key = g_string_new(NULL);
+    g_string_append_len(key, bus_name ? bus_name : "", strlen(bus_name ? bus_name : "") + 1);
+    g_string_append_len(key, object_path, strlen(object_path) + 1);
+    g_string_append_len(key, interface_name, strlen(interface_name) + 1);
+    g_string_append_len(key, method_name, strlen(method_name) + 1);
+    if (params) {
+        g_string_append_len(key, g_variant_get_type_string(params), strlen(g_variant_get_type_string(params)) + 1);
+        g_string_append_len(key, g_variant_get_data(params), g_variant_get_size(params));
     }
 
-    /* Remove thread from registry, so garbage collection can take place */
-    lua_pushlightuserdata(T, T);
-    lua_pushnil(T);
-    lua_rawset(T, LUA_REGISTRYINDEX);
+    return g_string_free_to_bytes(key);
 }
 
 static inline gboolean in_mainloop(struct easydbus_state *state)
 {
-    return (state->loop || state->ref_cb != -1);
+    return !state->blocking && (state->loop || state->ref_cb != -1 || state->epoll_fd != -1);
+}
+
+enum route_state {
+    ROUTE_UNKNOWN,  /* not resolved yet, calls go to well-known name */
+    ROUTE_OWNED,
+    ROUTE_VANISHED,
+};
+
+/* Unique name of well-known name owner, tracked by name watcher */
+struct route {
+    enum route_state state;
+    gchar *owner;
+    guint watch_id;
+};
+
+static void route_appeared(GDBusConnection *conn, const gchar *name, const gchar *name_owner, gpointer user_data)
+{
+    struct route *route = user_data;
+
+    ed_debug("%s: %s -> %s", __FUNCTION__, name, name_owner);
+
+    g_free(route->owner);
+    route->owner = g_strdup(name_owner);
+    route->state = ROUTE_OWNED;
+}
+
+static void route_vanished(GDBusConnection *conn, const gchar *name, gpointer user_data)
+{
+    struct route *route = user_data;
+
+    ed_debug("%s: %s", __FUNCTION__, name);
+
+    g_clear_pointer(&route->owner, g_free);
+    route->state = ROUTE_VANISHED;
+}
+
+static void route_free(gpointer user_data)
+{
+    struct route *route = user_data;
+
+    g_free(route->owner);
+    g_free(route);
+}
+
+/*
+ * Returns unique name of routed well-known name owner, or bus_name itself if
+ * it is not routed (or not resolved yet). NULL is returned if routed name
+ * has no owner.
+ */
+static const char *route_destination(struct easydbus_conn *bus, const char *bus_name)
+{
+    struct route *route;
+
+    if (!bus_name || !g_hash_table_size(bus->routes))
+        return bus_name;
+
+    route = g_hash_table_lookup(bus->routes, bus_name);
+    if (!route || route->state == ROUTE_UNKNOWN)
+        return bus_name;
+
+    return route->owner;
+}
+
+struct call_error {
+    lua_State *T;
+    GError *error;
+};
+
+static gboolean call_error_idle(gpointer user_data)
+{
+    struct call_error *call_error = user_data;
+
+    resume_call(call_error->T, NULL, NULL, call_error->error);
+    g_error_free(call_error->error);
+    g_free(call_error);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Resumes callback of thread T with error from mainloop, as caller has not
+ * yielded yet. Takes ownership of error.
+ */
+static void fail_call(struct easydbus_state *state, lua_State *T, GError *error)
+{
+    struct call_error *call_error = g_new(struct call_error, 1);
+
+    call_error->T = T;
+    call_error->error = error;
+
+    g_idle_add(call_error_idle, call_error);
+    g_main_context_wakeup(state->context);
+}
+
+/* Pushes nil and error message of call to name without owner */
+static int push_no_owner(lua_State *L, const char *bus_name)
+{
+    lua_pushnil(L);
+    lua_pushfstring(L, "Name %s has no owner", bus_name);
+    return 2;
 }
 
 /*
  * Args:
  * 1) conn
- * 2) bus_name
+ * 2) bus_name (nil on peer to peer connections)
  * 3) object_path
  * 4) interface_name
  * 5) method_name
@@ -91,36 +302,58 @@ static inline gboolean in_mainloop(struct easydbus_state *state)
 static int bus_call(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    GDBusConnection *conn = get_conn(L, 1);
-    const char *bus_name = luaL_checkstring(L, 2);
+    struct easydbus_conn *bus = check_bus(L, 1);
+    GDBusConnection *conn = bus->conn;
+    const char *bus_name = lua_tostring(L, 2);
     const char *object_path = luaL_checkstring(L, 3);
     const char *interface_name = luaL_checkstring(L, 4);
     const char *method_name = luaL_checkstring(L, 5);
     const char *sig = lua_tostring(L, 6);
+    const char *destination;
     GVariant *params = NULL;
+    gsize params_size;
     lua_State *T;
+    struct call_ud *call_ud;
     int i, n_args = lua_gettop(L);
     int n_params = n_args - 6;
     GUnixFDList *fd_list = g_unix_fd_list_new();
 
-    g_debug("%s: conn=%p bus_name=%s object_path=%s interface_name=%s method_name=%s sig=%s",
-            __FUNCTION__, (void *) conn, bus_name, object_path, interface_name, method_name, sig);
+    ed_debug("%s: conn=%p bus_name=%s object_path=%s interface_name=%s method_name=%s sig=%s",
+             __FUNCTION__, (void *) conn, bus_name, object_path, interface_name, method_name, sig);
 
-    luaL_argcheck(L, g_dbus_is_name(bus_name), 2, "Invalid bus name");
+    /* No bus name on peer to peer connections */
+    if (bus_name)
+        luaL_argcheck(L, g_dbus_is_name(bus_name), 2, "Invalid bus name");
+    else
+        luaL_argcheck(L, !g_dbus_connection_get_unique_name(conn), 2, "Bus name not specified");
     luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
     luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 4, "Invalid interface name");
 
+    destination = route_destination(bus, bus_name);
+
     if (!in_mainloop(state)) {
         GVariant *result;
         GError *error = NULL;
         int ret;
         GUnixFDList *out_fd_list = NULL;
+        struct method_stats *stats;
+        gint64 start_time;
+        guint32 serial;
+
+        if (bus_name && !destination) {
+            g_object_unref(fd_list);
+            return push_no_owner(L, bus_name);
+        }
 
         if (n_params > 0)
             params = range_to_tuple(L, 7, 7 + n_params, sig, fd_list);
 
+        stats = stats_begin(bus->client_stats, interface_name, method_name);
+        start_time = g_get_monotonic_time();
+        ED_PROBE3(call_send, 0, method_name, start_time);
+
         result = g_dbus_connection_call_with_unix_fd_list_sync(conn,
-                                                               bus_name,
+                                                               destination,
                                                                object_path,
                                                                interface_name,
                                                                method_name,
@@ -133,6 +366,14 @@ static int bus_call(lua_State *L)
                                                                NULL,
                                                                &error);
 
+        stats_end(stats, start_time, error != NULL);
+
+        /* Serial is known only after message was sent */
+        serial = g_dbus_connection_get_last_serial(conn);
+        trace_event_at(TRACE_CALL, serial, method_name, start_time);
+        trace_event(error ? TRACE_CALL_ERROR : TRACE_CALL_REPLY, serial, method_name);
+        ED_PROBE4(call_reply, serial, method_name, start_time, error != NULL);
+
         g_object_unref(fd_list);
 
         if (error) {
@@ -155,15 +396,11 @@ static int bus_call(lua_State *L)
 
     T = lua_newthread(L);
 
-    lua_pushlightuserdata(L, conn);
-    for (i = 2; i <= n_args; i++) {
+    /* Keep bus object alive until reply arrives */
+    lua_pushvalue(L, 1);
+    for (i = 2; i <= n_args; i++)
         lua_pushvalue(L, i);
-
-        if (lua_type(L, i) == LUA_TSTRING)
-            g_debug("arg %d: %s", i, lua_tostring(L, i));
-        else
-            g_debug("arg %d: type=%s", i, lua_typename(L, lua_type(L, i)));
-    }
+    ed_debug_args(L, 2, n_args);
     lua_xmove(L, T, n_args);
 
     /* Push thread to registry so we will prevent garbage collection */
@@ -172,149 +409,546 @@ static int bus_call(lua_State *L)
     lua_rawset(L, LUA_REGISTRYINDEX);
     lua_pop(L, 1);
 
+    /* Fail fast instead of waiting for timeout */
+    if (bus_name && !destination) {
+        fail_call(state, T, g_error_new(G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER,
+                                        "Name %s has no owner", bus_name));
+        g_object_unref(fd_list);
+        return 0;
+    }
+
     /* Read parameters */
     if (n_params > 0)
         params = range_to_tuple(L, 7, 7 + n_params, sig, fd_list);
 
-    g_dbus_connection_call(conn,
-                           bus_name,
-                           object_path,
-                           interface_name,
-                           method_name,
-                           params, /* parameters */
-                           NULL, /* reply_type */
-                           G_DBUS_CALL_FLAGS_NONE,
-                           -1, /* default timeout */
-                           NULL /* cancellable */,
-                           call_callback,
-                           T);
+    call_ud = g_new0(struct call_ud, 1);
+    call_ud->T = T;
+
+    call_ud->key = coalesce_key(bus, destination, object_path, interface_name, method_name, params, fd_list);
+    if (call_ud->key) {
+        GPtrArray *waiters = g_hash_table_lookup(bus->inflight, call_ud->key);
+
+        /* Wait for reply of identical call which is already in flight */
+        if (waiters) {
+            ed_debug("coalescing with call in flight");
+            g_ptr_array_add(waiters, T);
+            if (params)
+                g_variant_unref(g_variant_ref_sink(params));
+            g_bytes_unref(call_ud->key);
+            g_free(call_ud);
+            g_object_unref(fd_list);
+            return 0;
+        }
+
+        g_hash_table_insert(bus->inflight, g_bytes_ref(call_ud->key), g_ptr_array_new());
+        call_ud->inflight = g_hash_table_ref(bus->inflight);
+    }
+
+    call_ud->stats_table = g_hash_table_ref(bus->client_stats);
+    call_ud->stats = stats_begin(bus->client_stats, interface_name, method_name);
+    call_ud->start_time = g_get_monotonic_time();
+
+    params_size = params ? g_variant_get_size(params) : 0;
+
+    g_dbus_connection_call_with_unix_fd_list(conn,
+                                             destination,
+                                             object_path,
+                                             interface_name,
+                                             method_name,
+                                             params, /* parameters */
+                                             NULL, /* reply_type */
+                                             G_DBUS_CALL_FLAGS_NONE,
+                                             -1, /* default timeout */
+                                             fd_list,
+                                             NULL /* cancellable */,
+                                             call_callback,
+                                             call_ud);
+    bus->pending_calls++;
+
+    call_ud->serial = g_dbus_connection_get_last_serial(conn);
+    outgoing_queue_add(bus->queue, call_ud->serial, params_size);
+    trace_event_at(TRACE_CALL, call_ud->serial, method_name, call_ud->start_time);
+    ED_PROBE3(call_send, call_ud->serial, method_name, call_ud->start_time);
 
     g_object_unref(fd_list);
 
     return 0;
 }
 
-static int bus_introspect(lua_State *L)
+static void call_blob_callback(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    GDBusConnection *conn = get_conn(L, 1);
-    const char *bus_name = luaL_checkstring(L, 2);
-    const char *object_path = luaL_checkstring(L, 3);
-    const gchar *xml_data;
-    GDBusNodeInfo *node;
-    GVariant *result;
+    struct call_ud *call_ud = user_data;
+    lua_State *T = call_ud->T;
+    struct easydbus_conn *bus = lua_touserdata(T, 1);
     GError *error = NULL;
-    int i;
-    int m;
+    GDBusMessage *reply = g_dbus_connection_send_message_with_reply_finish(G_DBUS_CONNECTION(source),
+                                                                           res, &error);
 
-    result = g_dbus_connection_call_sync(conn,
-                                         bus_name,
-                                         object_path,
-                                         "org.freedesktop.DBus.Introspectable",
-                                         "Introspect",
-                                         NULL,
-                                         G_VARIANT_TYPE("(s)"),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
-                                         NULL,
-                                         &error);
+    bus->pending_calls--;
 
-    if (!result) {
-        lua_pushnil(L);
-        lua_pushstring(L, error->message);
-        g_error_free(error);
-        return 2;
+    if (reply && g_dbus_message_to_gerror(reply, &error))
+        g_clear_object(&reply);
+
+    /* Member name is kept at T[2] */
+    trace_event(error ? TRACE_CALL_ERROR : TRACE_CALL_REPLY, call_ud->serial, lua_tostring(T, 2));
+    ED_PROBE4(call_reply, call_ud->serial, lua_tostring(T, 2), call_ud->start_time, error != NULL);
+
+    stats_end(call_ud->stats, call_ud->start_time, error != NULL);
+    g_hash_table_unref(call_ud->stats_table);
+    g_free(call_ud);
+
+    /* Drop member name, leaving callback and callback_arg */
+    lua_remove(T, 2);
+
+    if (reply) {
+        lua_pushboolean(T, 1);
+        ed_resume(T, 2);
+        g_object_unref(reply);
+    } else {
+        lua_pushnil(T);
+        lua_pushstring(T, error->message);
+        ed_resume(T, 3);
+        g_clear_error(&error);
     }
 
-    g_variant_get(result, "(&s)", &xml_data);
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+}
 
-    error = NULL;
-    node = g_dbus_node_info_new_for_xml(xml_data, &error);
-    g_variant_unref(result);
+/*
+ * Sends method call serialized as D-Bus message blob (e.g. taken from
+ * capture), returns true once reply arrives.
+ *
+ * Args:
+ * 1) conn
+ * 2) blob
+ * 3) destination override (optional)
+ * 4) callback
+ * 5) callback_arg
+ */
+static int bus_call_blob(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    struct easydbus_conn *bus = check_bus(L, 1);
+    size_t size;
+    const char *blob = luaL_checklstring(L, 2, &size);
+    const char *destination = lua_tostring(L, 3);
+    const char *interface_name;
+    const char *member;
+    GDBusMessage *message;
+    GVariant *body;
+    GError *error = NULL;
+    struct call_ud *call_ud;
+    lua_State *T;
 
-    if (!node) {
+    if (destination)
+        luaL_argcheck(L, g_dbus_is_name(destination), 3, "Invalid bus name");
+    if (in_mainloop(state))
+        luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    message = g_dbus_message_new_from_blob((guchar *) blob, size, G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING, &error);
+    if (!message) {
         lua_pushnil(L);
         lua_pushstring(L, error->message);
         g_error_free(error);
         return 2;
     }
 
-    lua_newtable(L);
-    if (node->interfaces) {
-        for (i = 0; node->interfaces[i] != NULL; i++) {
-            const GDBusInterfaceInfo *iface = node->interfaces[i];
-            lua_pushstring(L, iface->name);
-            lua_newtable(L);
-            if (iface->methods) {
-                for (m = 0; iface->methods[m] != NULL; m++) {
-                    GDBusMethodInfo *method = iface->methods[m];
-                    lua_pushstring(L, method->name);
-                    lua_rawseti(L, -2, m+1);
-                }
-            }
-            lua_rawset(L, -3);
-        }
+    if (g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL) {
+        g_object_unref(message);
+        return luaL_argerror(L, 2, "Not a method call");
     }
-    return 1;
-}
 
-static GDBusArgInfo **add_args_info(lua_State *L, int tab_index, int arg_index)
-{
-    char *sig;
-    const char *startptr, *endptr;
-    GDBusArgInfo *arg_info;
-    GPtrArray *args = g_ptr_array_new();
-    gboolean ret = TRUE;
+    if (destination)
+        g_dbus_message_set_destination(message, destination);
+    /* Sender is filled in by bus daemon */
+    g_dbus_message_set_sender(message, NULL);
 
-    lua_rawgeti(L, tab_index, arg_index);
-    startptr = lua_tostring(L, -1);
-    while (*startptr != '\0' && (ret = g_variant_type_string_scan(startptr, NULL, &endptr))) {
-        sig = g_strndup(startptr, endptr - startptr);
+    /* Interface is optional in method calls */
+    interface_name = g_dbus_message_get_interface(message);
+    if (!interface_name)
+        interface_name = "";
+    member = g_dbus_message_get_member(message);
 
-        arg_info = g_new0(GDBusArgInfo, 1);
-        g_ptr_array_add(args, arg_info);
+    if (!in_mainloop(state)) {
+        struct method_stats *stats;
+        gint64 start_time = g_get_monotonic_time();
+        GDBusMessage *reply;
+        guint32 serial = 0;
 
-        arg_info->ref_count = 1;
-        arg_info->signature = sig;
+        stats = stats_begin(bus->client_stats, interface_name, member);
+        ED_PROBE3(call_send, 0, member, start_time);
+        reply = g_dbus_connection_send_message_with_reply_sync(bus->conn, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                                               -1, &serial, NULL, &error);
 
-        startptr = endptr;
+        if (reply && g_dbus_message_to_gerror(reply, &error))
+            g_clear_object(&reply);
+
+        stats_end(stats, start_time, error != NULL);
+
+        trace_event_at(TRACE_CALL, serial, member, start_time);
+        trace_event(error ? TRACE_CALL_ERROR : TRACE_CALL_REPLY, serial, member);
+        ED_PROBE4(call_reply, serial, member, start_time, error != NULL);
+        g_object_unref(message);
+
+        if (!reply) {
+            lua_pushnil(L);
+            lua_pushstring(L, error->message);
+            g_error_free(error);
+            return 2;
+        }
+
+        g_object_unref(reply);
+        lua_pushboolean(L, 1);
+        return 1;
     }
 
-    if (!ret)
-        g_error("Wrong signature");
+    lua_settop(L, 5);
 
+    /* Thread stack: bus, member, callback, callback_arg */
+    T = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_pushstring(L, member);
+    lua_pushvalue(L, 4);
+    lua_pushvalue(L, 5);
+    lua_xmove(L, T, 4);
+
+    lua_pushlightuserdata(L, T);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
     lua_pop(L, 1);
 
-    g_ptr_array_add(args, NULL);
-    return (GDBusArgInfo **) g_ptr_array_free(args, FALSE);
+    call_ud = g_new0(struct call_ud, 1);
+    call_ud->T = T;
+    call_ud->stats_table = g_hash_table_ref(bus->client_stats);
+    call_ud->stats = stats_begin(bus->client_stats, interface_name, member);
+    call_ud->start_time = g_get_monotonic_time();
+
+    g_dbus_connection_send_message_with_reply(bus->conn, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                              -1, &call_ud->serial, NULL, call_blob_callback, call_ud);
+    bus->pending_calls++;
+
+    body = g_dbus_message_get_body(message);
+    outgoing_queue_add(bus->queue, call_ud->serial, body ? g_variant_get_size(body) : 0);
+    trace_event_at(TRACE_CALL, call_ud->serial, member, call_ud->start_time);
+    ED_PROBE3(call_send, call_ud->serial, member, call_ud->start_time);
+    g_object_unref(message);
+
+    return 0;
 }
 
-static void add_method_info(lua_State *L, GPtrArray *methods)
+static void push_json(lua_State *L, GVariant *value)
 {
-    int index = lua_gettop(L);
-    const char *method_name = lua_tostring(L, -2);
-    GDBusMethodInfo *method_info = g_new0(GDBusMethodInfo, 1);
-    GDBusArgInfo **in_args;
-    GDBusArgInfo **out_args;
-
-    in_args = add_args_info(L, index, 1);
-    out_args = add_args_info(L, index, 2);
+    GString *str = g_string_sized_new(256);
 
-    g_ptr_array_add(methods, method_info);
-    method_info->ref_count = 1;
-    method_info->name = g_strdup(method_name);
-    method_info->in_args = in_args;
-    method_info->out_args = out_args;
+    append_json(str, value);
+    lua_pushlstring(L, str->str, str->len);
+    g_string_free(str, TRUE);
 }
 
-static GDBusInterfaceInfo *format_interface_info(lua_State *L, int index,
-                                                 const char *interface_name)
+static void call_json_callback(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    GDBusInterfaceInfo *interface_info;
-    GPtrArray *methods = g_ptr_array_new();
+    struct call_ud *call_ud = user_data;
+    lua_State *T = call_ud->T;
+    struct easydbus_conn *bus = lua_touserdata(T, 1);
+    GError *error = NULL;
+    GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
 
-    lua_pushnil(L);
+    bus->pending_calls--;
+
+    /* Method name is kept at T[2] */
+    trace_event(error ? TRACE_CALL_ERROR : TRACE_CALL_REPLY, call_ud->serial, lua_tostring(T, 2));
+    ED_PROBE4(call_reply, call_ud->serial, lua_tostring(T, 2), call_ud->start_time, error != NULL);
+
+    stats_end(call_ud->stats, call_ud->start_time, error != NULL);
+    g_hash_table_unref(call_ud->stats_table);
+    g_free(call_ud);
+
+    /* Drop method name, leaving callback and callback_arg */
+    lua_remove(T, 2);
+
+    if (result) {
+        push_json(T, result);
+        ed_resume(T, 2);
+        g_variant_unref(result);
+    } else {
+        lua_pushnil(T);
+        lua_pushstring(T, error->message);
+        ed_resume(T, 3);
+        g_clear_error(&error);
+    }
+
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+}
+
+/*
+ * Calls method with parameters given as JSON array and returns reply
+ * arguments as JSON array, without building Lua values in between.
+ *
+ * Args:
+ * 1) conn
+ * 2) bus_name (nil on peer to peer connections)
+ * 3) object_path
+ * 4) interface_name
+ * 5) method_name
+ * 6) signature
+ * 7) JSON array of parameters (optional)
+ * 8) callback
+ * 9) callback_arg
+ */
+static int bus_call_json(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    struct easydbus_conn *bus = check_bus(L, 1);
+    const char *bus_name = lua_tostring(L, 2);
+    const char *object_path = luaL_checkstring(L, 3);
+    const char *interface_name = luaL_checkstring(L, 4);
+    const char *method_name = luaL_checkstring(L, 5);
+    const char *sig = luaL_optstring(L, 6, "");
+    const char *json = luaL_optstring(L, 7, "[]");
+    const char *destination;
+    GVariant *params;
+    gsize params_size;
+    GError *error = NULL;
+    struct call_ud *call_ud;
+    gchar *tuple_sig;
+    lua_State *T;
+
+    if (bus_name)
+        luaL_argcheck(L, g_dbus_is_name(bus_name), 2, "Invalid bus name");
+    else
+        luaL_argcheck(L, !g_dbus_connection_get_unique_name(bus->conn), 2, "Bus name not specified");
+    luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
+    luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 4, "Invalid interface name");
+
+    if (in_mainloop(state))
+        luaL_checktype(L, 8, LUA_TFUNCTION);
+
+    tuple_sig = g_strdup_printf("(%s)", sig);
+    if (!g_variant_type_string_is_valid(tuple_sig)) {
+        g_free(tuple_sig);
+        return luaL_argerror(L, 6, "Invalid signature");
+    }
+    params = json_to_variant(json, G_VARIANT_TYPE(tuple_sig), &error);
+    g_free(tuple_sig);
+
+    destination = route_destination(bus, bus_name);
+
+    if (!in_mainloop(state)) {
+        struct method_stats *stats;
+        gint64 start_time;
+        guint32 serial;
+        GVariant *result;
+
+        /* Invalid JSON is reported like from_json() does */
+        if (!params) {
+            lua_pushnil(L);
+            lua_pushstring(L, error->message);
+            g_error_free(error);
+            return 2;
+        }
+
+        if (bus_name && !destination) {
+            g_variant_unref(g_variant_ref_sink(params));
+            return push_no_owner(L, bus_name);
+        }
+
+        stats = stats_begin(bus->client_stats, interface_name, method_name);
+        start_time = g_get_monotonic_time();
+        ED_PROBE3(call_send, 0, method_name, start_time);
+
+        result = g_dbus_connection_call_sync(bus->conn, destination, object_path, interface_name, method_name,
+                                             params, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+
+        stats_end(stats, start_time, error != NULL);
+
+        serial = g_dbus_connection_get_last_serial(bus->conn);
+        trace_event_at(TRACE_CALL, serial, method_name, start_time);
+        trace_event(error ? TRACE_CALL_ERROR : TRACE_CALL_REPLY, serial, method_name);
+        ED_PROBE4(call_reply, serial, method_name, start_time, error != NULL);
+
+        if (!result) {
+            lua_pushnil(L);
+            lua_pushstring(L, error->message);
+            g_error_free(error);
+            return 2;
+        }
+
+        push_json(L, result);
+        g_variant_unref(result);
+        return 1;
+    }
+
+    lua_settop(L, 9);
+
+    /* Thread stack: bus, method_name, callback, callback_arg */
+    T = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 5);
+    lua_pushvalue(L, 8);
+    lua_pushvalue(L, 9);
+    lua_xmove(L, T, 4);
+
+    lua_pushlightuserdata(L, T);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    if (!params) {
+        fail_call(state, T, error);
+        return 0;
+    }
+
+    if (bus_name && !destination) {
+        g_variant_unref(g_variant_ref_sink(params));
+        fail_call(state, T, g_error_new(G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER,
+                                        "Name %s has no owner", bus_name));
+        return 0;
+    }
+
+    call_ud = g_new0(struct call_ud, 1);
+    call_ud->T = T;
+    call_ud->stats_table = g_hash_table_ref(bus->client_stats);
+    call_ud->stats = stats_begin(bus->client_stats, interface_name, method_name);
+    call_ud->start_time = g_get_monotonic_time();
+
+    params_size = g_variant_get_size(params);
+    g_dbus_connection_call(bus->conn, destination, object_path, interface_name, method_name,
+                           params, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, call_json_callback, call_ud);
+    bus->pending_calls++;
+
+    call_ud->serial = g_dbus_connection_get_last_serial(bus->conn);
+    outgoing_queue_add(bus->queue, call_ud->serial, params_size);
+    trace_event_at(TRACE_CALL, call_ud->serial, method_name, call_ud->start_time);
+    ED_PROBE3(call_send, call_ud->serial, method_name, call_ud->start_time);
+
+    return 0;
+}
+
+static int bus_introspect(lua_State *L)
+{
+    GDBusConnection *conn = get_conn(L, 1);
+    const char *bus_name = luaL_checkstring(L, 2);
+    const char *object_path = luaL_checkstring(L, 3);
+    const gchar *xml_data;
+    GDBusNodeInfo *node;
+    GVariant *result;
+    GError *error = NULL;
+    int i;
+    int m;
+
+    result = g_dbus_connection_call_sync(conn,
+                                         bus_name,
+                                         object_path,
+                                         "org.freedesktop.DBus.Introspectable",
+                                         "Introspect",
+                                         NULL,
+                                         G_VARIANT_TYPE("(s)"),
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1,
+                                         NULL,
+                                         &error);
+
+    if (!result) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    g_variant_get(result, "(&s)", &xml_data);
+
+    error = NULL;
+    node = g_dbus_node_info_new_for_xml(xml_data, &error);
+    g_variant_unref(result);
+
+    if (!node) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    lua_newtable(L);
+    if (node->interfaces) {
+        for (i = 0; node->interfaces[i] != NULL; i++) {
+            const GDBusInterfaceInfo *iface = node->interfaces[i];
+            lua_pushstring(L, iface->name);
+            lua_newtable(L);
+            if (iface->methods) {
+                for (m = 0; iface->methods[m] != NULL; m++) {
+                    GDBusMethodInfo *method = iface->methods[m];
+                    lua_pushstring(L, method->name);
+                    lua_rawseti(L, -2, m+1);
+                }
+            }
+            lua_rawset(L, -3);
+        }
+    }
+    return 1;
+}
+
+static GDBusArgInfo **add_args_info(lua_State *L, int tab_index, int arg_index)
+{
+    char *sig;
+    const char *startptr, *endptr;
+    GDBusArgInfo *arg_info;
+    GPtrArray *args = g_ptr_array_new();
+    gboolean ret = TRUE;
+
+    lua_rawgeti(L, tab_index, arg_index);
+    startptr = lua_tostring(L, -1);
+    while (*startptr != '\0' && (ret = g_variant_type_string_scan(startptr, NULL, &endptr))) {
+        sig = g_strndup(startptr, endptr - startptr);
+
+        arg_info = g_new0(GDBusArgInfo, 1);
+        g_ptr_array_add(args, arg_info);
+
+        arg_info->ref_count = 1;
+        arg_info->signature = sig;
+
+        startptr = endptr;
+    }
+
+    if (!ret)
+        g_error("Wrong signature");
+
+    lua_pop(L, 1);
+
+    g_ptr_array_add(args, NULL);
+    return (GDBusArgInfo **) g_ptr_array_free(args, FALSE);
+}
+
+static void add_method_info(lua_State *L, GPtrArray *methods)
+{
+    int index = lua_gettop(L);
+    const char *method_name = lua_tostring(L, -2);
+    GDBusMethodInfo *method_info = g_new0(GDBusMethodInfo, 1);
+    GDBusArgInfo **in_args;
+    GDBusArgInfo **out_args;
+
+    in_args = add_args_info(L, index, 1);
+    out_args = add_args_info(L, index, 2);
+
+    g_ptr_array_add(methods, method_info);
+    method_info->ref_count = 1;
+    method_info->name = g_strdup(method_name);
+    method_info->in_args = in_args;
+    method_info->out_args = out_args;
+}
+
+static GDBusInterfaceInfo *format_interface_info(lua_State *L, int index,
+                                                 const char *interface_name)
+{
+    GDBusInterfaceInfo *interface_info;
+    GPtrArray *methods = g_ptr_array_new();
+
+    lua_pushnil(L);
     while (lua_next(L, index) != 0) {
-        g_debug("Parsing method: %s", lua_tostring(L, -2));
+        ed_debug("Parsing method: %s", lua_tostring(L, -2));
         add_method_info(L, methods);
         lua_pop(L, 1);
     }
@@ -333,43 +967,87 @@ static GDBusInterfaceInfo *format_interface_info(lua_State *L, int index,
  * Args:
  * 1) invocation method
  */
+/* Pending reply to incoming method call */
+struct method_invocation {
+    GDBusMethodInvocation *invocation; /* NULL once replied */
+    gchar *out_sig;
+    GHashTable *stats_table;
+    struct method_stats *stats;
+    gint64 start_time;
+    guint32 serial;
+};
+
+static void method_invocation_return_error(struct method_invocation *mi, const char *message)
+{
+    const gchar *method_name = g_dbus_method_invocation_get_method_name(mi->invocation);
+
+    trace_event(TRACE_METHOD_ERROR, mi->serial, method_name);
+    ED_PROBE4(method_return, mi->serial, method_name, mi->start_time, 1);
+    stats_end(mi->stats, mi->start_time, TRUE);
+
+    g_dbus_method_invocation_return_dbus_error(mi->invocation, "org.freedesktop.DBus.Error.Failed", message);
+    mi->invocation = NULL;
+}
+
+static int method_invocation__gc(lua_State *L)
+{
+    struct method_invocation *mi = lua_touserdata(L, 1);
+
+    /* Do not leave caller waiting for a reply which will never come */
+    if (mi->invocation)
+        method_invocation_return_error(mi, "Method handler did not return");
+
+    g_free(mi->out_sig);
+    g_hash_table_unref(mi->stats_table);
+
+    return 0;
+}
+
 static int interface_method_return(lua_State *L)
 {
+    struct method_invocation *mi = lua_touserdata(L, 1);
     GDBusMethodInvocation *invocation;
     const gchar *sender;
     const gchar *object_path;
     const gchar *interface_name;
     const gchar *method_name;
-    int i, n_args = lua_gettop(L);
+    int n_args = lua_gettop(L);
     GVariant *result;
     const char *out_sig;
-    GUnixFDList *fd_list = g_unix_fd_list_new();
+    GUnixFDList *fd_list;
+    int is_invocation = 0;
 
-    luaL_argcheck(L, lua_istable(L, 1), 1, "table expected");
-    lua_rawgeti(L, 1, 1);
-    lua_rawgeti(L, 1, 2);
-    invocation = lua_touserdata(L, -2);
-    out_sig = lua_tostring(L, -1);
-    lua_pop(L, 2);
+    if (mi && lua_getmetatable(L, 1)) {
+        lua_pushlightuserdata(L, INVOCATION_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        is_invocation = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    luaL_argcheck(L, is_invocation, 1, "invocation expected");
+    luaL_argcheck(L, mi->invocation != NULL, 1, "Method already returned");
+
+    invocation = mi->invocation;
+    out_sig = mi->out_sig;
 
     sender = g_dbus_method_invocation_get_sender(invocation);
     object_path = g_dbus_method_invocation_get_object_path(invocation);
     interface_name = g_dbus_method_invocation_get_interface_name(invocation);
     method_name = g_dbus_method_invocation_get_method_name(invocation);
 
-    g_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s out_sig=%s",
-            __FUNCTION__, sender, object_path, interface_name, method_name, out_sig);
+    ed_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s out_sig=%s",
+             __FUNCTION__, sender, object_path, interface_name, method_name, out_sig);
 
-    for (i = 2; i <= n_args; i++) {
-        if (lua_type(L, i) == LUA_TSTRING)
-            g_debug("arg %d type=%s value=%s", i, lua_typename(L, lua_type(L, i)), lua_tostring(L, i));
-        else
-            g_debug("arg %d type=%s", i, lua_typename(L, lua_type(L, i)));
-    }
+    ed_debug_args(L, 2, n_args);
 
+    fd_list = g_unix_fd_list_new();
     result = range_to_tuple(L, 2, n_args + 1, out_sig, fd_list);
 
+    trace_event(TRACE_METHOD_RETURN, mi->serial, method_name);
+    ED_PROBE4(method_return, mi->serial, method_name, mi->start_time, 0);
+    stats_end(mi->stats, mi->start_time, FALSE);
+
     g_dbus_method_invocation_return_value_with_unix_fd_list(invocation, result, fd_list);
+    mi->invocation = NULL;
 
     g_object_unref(fd_list);
 
@@ -379,6 +1057,7 @@ static int interface_method_return(lua_State *L)
 struct object_ud {
     struct easydbus_state *state;
     int ref;
+    GHashTable *stats_table; /* NULL for signal subscriptions */
 };
 
 static void object_ud_free(gpointer user_data)
@@ -386,9 +1065,11 @@ static void object_ud_free(gpointer user_data)
     struct object_ud *obj_ud = user_data;
     struct easydbus_state *state = obj_ud->state;
 
-    g_debug("%s: %p", __FUNCTION__, user_data);
+    ed_debug("%s: %p", __FUNCTION__, user_data);
 
     luaL_unref(state->L, LUA_REGISTRYINDEX, obj_ud->ref);
+    if (obj_ud->stats_table)
+        g_hash_table_unref(obj_ud->stats_table);
 
     g_free(user_data);
 }
@@ -412,9 +1093,10 @@ static void interface_method_call(GDBusConnection *connection,
     int i;
     GDBusMessage *message;
     GUnixFDList *fd_list;
+    struct method_invocation *mi;
 
-    g_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s",
-            __FUNCTION__, sender, object_path, interface_name, method_name);
+    ed_debug("%s: sender=%s object_path=%s interface_name=%s method_name=%s",
+             __FUNCTION__, sender, object_path, interface_name, method_name);
 
     T = lua_newthread(state->L);
 
@@ -426,31 +1108,43 @@ static void interface_method_call(GDBusConnection *connection,
         luaL_error(T, "No %s in methods lookup", method_name);
 
     n_args = lua_rawlen(T, 2);
-    for (i = 3; i <= n_args; i++) {
+    for (i = 3; i <= n_args; i++)
         lua_rawgeti(T, 2, i);
-        if (lua_type(T, -1) == LUA_TSTRING)
-            g_debug("arg %d: %s", i, lua_tostring(T, -1));
-        else
-            g_debug("arg %d: %s", i, lua_typename(T, lua_type(T, -1)));
-    }
+    ed_debug_args(T, 3, n_args);
 
     /* push params */
     message = g_dbus_method_invocation_get_message(invocation);
+    trace_event(TRACE_METHOD, g_dbus_message_get_serial(message), method_name);
     fd_list = g_dbus_message_get_unix_fd_list(message);
     n_params = push_tuple(T, parameters, fd_list);
     lua_pushcclosure(T, interface_method_return, 0);
-    lua_createtable(T, 2, 0);
-    lua_pushlightuserdata(T, invocation);
-    lua_rawseti(T, -2, 1);
+
+    mi = lua_newuserdata(T, sizeof(*mi));
+    mi->invocation = invocation;
     lua_rawgeti(T, 2, 2); /* out_sig */
-    lua_rawseti(T, -2, 2);
+    mi->out_sig = g_strdup(lua_tostring(T, -1));
+    lua_pop(T, 1);
+    mi->stats_table = g_hash_table_ref(obj_ud->stats_table);
+    mi->stats = stats_begin(obj_ud->stats_table, interface_name, method_name);
+    mi->start_time = g_get_monotonic_time();
+    mi->serial = g_dbus_message_get_serial(message);
+    ED_PROBE3(method_call, mi->serial, method_name, mi->start_time);
+    lua_pushlightuserdata(T, INVOCATION_MT);
+    lua_rawget(T, LUA_REGISTRYINDEX);
+    lua_setmetatable(T, -2);
+
     ret = ed_resume(T, n_args + n_params - 1);
 
     if (ret) {
-        if (ret == LUA_YIELD)
+        if (ret == LUA_YIELD) {
             g_warning("method handler yielded");
-        else
+        } else {
             g_warning("method handler error: %s", lua_tostring(T, -1));
+
+            /* Handler stack is not unwound on error, so mi is still referenced */
+            if (mi->invocation)
+                method_invocation_return_error(mi, lua_tostring(T, -1));
+        }
     }
 
     lua_pop(state->L, 1);
@@ -466,7 +1160,8 @@ static const GDBusInterfaceVTable interface_vtable = {
 static int bus_register_object(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    GDBusConnection *conn = get_conn(L, 1);
+    struct easydbus_conn *bus = check_bus(L, 1);
+    GDBusConnection *conn = bus->conn;
     const char *object_path = luaL_checkstring(L, 2);
     const char *interface_name = luaL_checkstring(L, 3);
     GDBusInterfaceInfo *interface_info;
@@ -474,8 +1169,8 @@ static int bus_register_object(lua_State *L)
     guint reg_id;
     struct object_ud *obj_ud;
 
-    g_debug("%s", __FUNCTION__);
-    g_debug("object_path=%s interface_name=%s", object_path, interface_name);
+    ed_debug("%s", __FUNCTION__);
+    ed_debug("object_path=%s interface_name=%s", object_path, interface_name);
 
     luaL_argcheck(L, lua_istable(L, 4), 4, "Is not a table");
 
@@ -487,6 +1182,7 @@ static int bus_register_object(lua_State *L)
     obj_ud = g_new(struct object_ud, 1);
     obj_ud->ref = luaL_ref(L, LUA_REGISTRYINDEX);
     obj_ud->state = state;
+    obj_ud->stats_table = g_hash_table_ref(bus->server_stats);
 
     reg_id = g_dbus_connection_register_object(conn,
                                                object_path,
@@ -505,29 +1201,81 @@ static int bus_register_object(lua_State *L)
         return 2;
     }
 
+    g_hash_table_add(bus->objects, GUINT_TO_POINTER(reg_id));
+    bus_anchor(L, bus, 1);
+
     lua_pushinteger(L, reg_id);
     return 1;
 }
 
 static int bus_unregister_object(lua_State *L)
 {
-    GDBusConnection *conn = get_conn(L, 1);
+    struct easydbus_conn *bus = check_bus(L, 1);
     guint reg_id = luaL_checkinteger(L, 2);
     gboolean ret;
 
-    ret = g_dbus_connection_unregister_object(conn, reg_id);
+    ret = g_dbus_connection_unregister_object(bus->conn, reg_id);
+    g_hash_table_remove(bus->objects, GUINT_TO_POINTER(reg_id));
+    bus_anchor(L, bus, 1);
 
     lua_pushboolean(L, ret ? 1 : 0);
     return 1;
 }
 
+/*
+ * Entry of bus->names, keyed by id returned to Lua. Names are requested with
+ * DO_NOT_QUEUE both in and outside of mainloop, so own_name() fails right
+ * away when name is taken.
+ */
+struct owned_name {
+    GDBusConnection *conn;
+    guint owner_id;     /* GDBus owner, 0 if requested synchronously */
+    gchar *name;        /* set if requested synchronously */
+};
+
+/* Releases name, called when entry is removed from bus->names */
+static void owned_name_free(gpointer data)
+{
+    struct owned_name *owned = data;
+
+    if (owned->owner_id)
+        g_bus_unown_name(owned->owner_id);
+    else
+        g_dbus_connection_call(owned->conn,
+                               "org.freedesktop.DBus",
+                               "/org/freedesktop/DBus",
+                               "org.freedesktop.DBus",
+                               "ReleaseName",
+                               g_variant_new("(s)", owned->name),
+                               NULL,
+                               G_DBUS_CALL_FLAGS_NONE,
+                               -1,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    g_free(owned->name);
+    g_free(owned);
+}
+
+static guint add_owned_name(struct easydbus_conn *bus, guint owner_id, const gchar *name)
+{
+    struct owned_name *owned = g_new(struct owned_name, 1);
+    guint id = ++bus->next_name_id;
+
+    owned->conn = bus->conn;
+    owned->owner_id = owner_id;
+    owned->name = g_strdup(name);
+    g_hash_table_insert(bus->names, GUINT_TO_POINTER(id), owned);
+
+    return id;
+}
+
 struct own_name_ud {
     struct easydbus_state *state;
     lua_State *L;
     gboolean handled;
-    GMainLoop *loop;
-    gboolean success;
-    guint owner_id;
+    guint id;
 };
 
 static void own_name_ud_free(gpointer user_data)
@@ -550,26 +1298,20 @@ static void name_acquired(GDBusConnection *conn,
     struct own_name_ud *own_name_ud = user_data;
     lua_State *L = own_name_ud->L;
 
-    g_debug("Acquired name: %s, handled=%d", name, (int) own_name_ud->handled);
+    ed_debug("Acquired name: %s, handled=%d", name, (int) own_name_ud->handled);
 
     if (own_name_ud->handled)
         return;
 
     own_name_ud->handled = TRUE;
 
-    if (own_name_ud->loop) {
-        own_name_ud->success = TRUE;
-        g_main_loop_quit(own_name_ud->loop);
-        return;
-    }
-
     lua_pushvalue(L, -2);
     lua_pushvalue(L, -2);
 
-    lua_pushinteger(L, own_name_ud->owner_id);
+    lua_pushinteger(L, own_name_ud->id);
     ed_resume(L, 2);
 
-    g_debug("after acquired callback");
+    ed_debug("after acquired callback");
 }
 
 static void name_lost(GDBusConnection *conn,
@@ -578,17 +1320,23 @@ static void name_lost(GDBusConnection *conn,
 {
     struct own_name_ud *own_name_ud = user_data;
     lua_State *L = own_name_ud->L;
+    struct easydbus_conn *bus;
 
-    g_debug("Lost name: %s, handled=%d", name, (int) own_name_ud->handled);
+    ed_debug("Lost name: %s, handled=%d", name, (int) own_name_ud->handled);
 
     if (own_name_ud->handled)
         return;
 
     own_name_ud->handled = TRUE;
 
-    if (own_name_ud->loop) {
-        g_main_loop_quit(own_name_ud->loop);
-        return;
+    /*
+     * Name was not acquired, so caller gets no id to unown it. GDBus keeps
+     * own_name_ud until this callback returns.
+     */
+    bus = lua_touserdata(L, 1);
+    if (bus->conn) {
+        g_hash_table_remove(bus->names, GUINT_TO_POINTER(own_name_ud->id));
+        bus_anchor(L, bus, 1);
     }
 
     lua_pushvalue(L, -2);
@@ -597,46 +1345,66 @@ static void name_lost(GDBusConnection *conn,
     lua_pushboolean(L, 0);
     ed_resume(L, 2);
 
-    g_debug("after lost callback");
+    ed_debug("after lost callback");
 }
 
 static int bus_own_name(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    GDBusConnection *conn = get_conn(L, 1);
+    struct easydbus_conn *bus = check_bus(L, 1);
+    GDBusConnection *conn = bus->conn;
     const char *name = luaL_checkstring(L, 2);
     lua_State *T;
     int i, n_args = lua_gettop(L);
     struct own_name_ud *own_name_ud;
 
-    g_debug("%s", __FUNCTION__);
-
-    own_name_ud = g_new0(struct own_name_ud, 1);
-    own_name_ud->state = state;
-    own_name_ud->L = T = lua_newthread(L);
+    ed_debug("%s", __FUNCTION__);
 
     if (!in_mainloop(state)) {
-        own_name_ud->owner_id =
-            g_bus_own_name_on_connection(conn,
-                                         name,
-                                         G_BUS_NAME_OWNER_FLAGS_NONE,
-                                         name_acquired,
-                                         name_lost,
-                                         own_name_ud,
-                                         own_name_ud_free);
-
-        own_name_ud->loop = g_main_loop_new(NULL, FALSE);
-        g_main_loop_run(own_name_ud->loop);
-        g_main_loop_unref(own_name_ud->loop);
-        own_name_ud->loop = NULL;
-
-        if (own_name_ud->success)
-            lua_pushinteger(L, own_name_ud->owner_id);
-        else
-            lua_pushboolean(L, 0);
+        GVariant *result;
+        GError *error = NULL;
+        guint32 reply;
+        guint id;
+
+        /* Request name directly, instead of spinning a nested main loop */
+        result = g_dbus_connection_call_sync(conn,
+                                             "org.freedesktop.DBus",
+                                             "/org/freedesktop/DBus",
+                                             "org.freedesktop.DBus",
+                                             "RequestName",
+                                             g_variant_new("(su)", name, 0x4 /* DO_NOT_QUEUE */),
+                                             G_VARIANT_TYPE("(u)"),
+                                             G_DBUS_CALL_FLAGS_NONE,
+                                             -1,
+                                             NULL,
+                                             &error);
+        if (!result) {
+            ed_debug("%s: %s", __FUNCTION__, error->message);
+            g_error_free(error);
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+
+        g_variant_get(result, "(u)", &reply);
+        g_variant_unref(result);
+
+        /* Only PRIMARY_OWNER counts, like in g_bus_own_name() */
+        if (reply != 1) {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+
+        id = add_owned_name(bus, 0, name);
+        bus_anchor(L, bus, 1);
+
+        lua_pushinteger(L, id);
         return 1;
     }
 
+    own_name_ud = g_new0(struct own_name_ud, 1);
+    own_name_ud->state = state;
+    own_name_ud->L = T = lua_newthread(L);
+
     for (i = 1; i <= n_args; i++) {
         lua_pushvalue(L, i);
     }
@@ -647,47 +1415,63 @@ static int bus_own_name(lua_State *L)
     lua_rawset(L, LUA_REGISTRYINDEX);
     lua_pop(L, 1);
 
-    own_name_ud->owner_id =
-        g_bus_own_name_on_connection(conn,
-                                     name,
-                                     G_BUS_NAME_OWNER_FLAGS_NONE,
-                                     name_acquired,
-                                     name_lost,
-                                     own_name_ud,
-                                     own_name_ud_free);
+    /* Callbacks run from mainloop, so id is set before them */
+    own_name_ud->id = add_owned_name(bus,
+                                     g_bus_own_name_on_connection(conn,
+                                                                  name,
+                                                                  G_BUS_NAME_OWNER_FLAGS_DO_NOT_QUEUE,
+                                                                  name_acquired,
+                                                                  name_lost,
+                                                                  own_name_ud,
+                                                                  own_name_ud_free),
+                                     NULL);
+    bus_anchor(L, bus, 1);
 
     return 0;
 }
 
 static int bus_unown_name(lua_State *L)
 {
-    guint owner_id = luaL_checkinteger(L, 2);
+    struct easydbus_conn *bus = check_bus(L, 1);
+    guint id = luaL_checkinteger(L, 2);
 
-    g_bus_unown_name(owner_id);
+    g_hash_table_remove(bus->names, GUINT_TO_POINTER(id));
+    bus_anchor(L, bus, 1);
 
     return 0;
 }
 
 static int bus_emit(lua_State *L)
 {
-    GDBusConnection *conn = get_conn(L, 1);
+    struct easydbus_conn *bus = check_bus(L, 1);
+    GDBusConnection *conn = bus->conn;
     const char *listener = lua_tostring(L, 2);
     const char *object_path = luaL_checkstring(L, 3);
     const char *interface_name = luaL_checkstring(L, 4);
     const char *signal_name = luaL_checkstring(L, 5);
     const char *sig = lua_tostring(L, 6);
     GVariant *params;
+    gsize params_size;
+    guint32 serial;
     GError *error = NULL;
 
-    g_debug("%s: listener=%s object_path=%s interface_name=%s signal_name=%s sig=%s",
-            __FUNCTION__, listener, object_path, interface_name, signal_name, sig);
+    ed_debug("%s: listener=%s object_path=%s interface_name=%s signal_name=%s sig=%s",
+             __FUNCTION__, listener, object_path, interface_name, signal_name, sig);
 
     if (listener)
         luaL_argcheck(L, g_dbus_is_name(listener), 2, "Invalid listener name");
     luaL_argcheck(L, g_variant_is_object_path(object_path), 3, "Invalid object path");
     luaL_argcheck(L, g_dbus_is_interface_name(interface_name), 4, "Invalid interface name");
 
+    /* Producer should back off (or flush) before queue grows any further */
+    if (outgoing_queue_full(bus->queue)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Outgoing queue full");
+        return 2;
+    }
+
     params = range_to_tuple(L, 7, lua_gettop(L) + 1, sig, NULL);
+    params_size = g_variant_get_size(params);
 
     g_dbus_connection_emit_signal(conn,
                                   listener,
@@ -704,6 +1488,10 @@ static int bus_emit(lua_State *L)
         return 2;
     }
 
+    serial = g_dbus_connection_get_last_serial(conn);
+    outgoing_queue_add(bus->queue, serial, params_size);
+    trace_event(TRACE_EMIT, serial, signal_name);
+
     lua_pushboolean(L, 1);
     return 1;
 }
@@ -724,7 +1512,10 @@ static void signal_callback(GDBusConnection *conn,
     int ret;
     int i;
 
-    g_debug("%s", __FUNCTION__);
+    ed_debug("%s", __FUNCTION__);
+
+    trace_event(TRACE_SIGNAL, 0, signal_name);
+    ED_PROBE5(signal, 0, signal_name, g_get_monotonic_time(), sender_name, object_name);
 
     L = lua_newthread(state->L);
 
@@ -748,7 +1539,8 @@ static void signal_callback(GDBusConnection *conn,
 static int bus_subscribe(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    GDBusConnection *conn = get_conn(L, 1);
+    struct easydbus_conn *bus = check_bus(L, 1);
+    GDBusConnection *conn = bus->conn;
     const char *sender = lua_tostring(L, 2);
     const char *object_path = lua_tostring(L, 3);
     const char *interface_name = lua_tostring(L, 4);
@@ -760,7 +1552,7 @@ static int bus_subscribe(lua_State *L)
 
     luaL_argcheck(L, !lua_isnoneornil(L, 6), 6, "Signal handler not specified");
 
-    g_debug("%s", __FUNCTION__);
+    ed_debug("%s", __FUNCTION__);
 
     lua_createtable(L, n_params - 5, 0);
 
@@ -771,6 +1563,7 @@ static int bus_subscribe(lua_State *L)
 
     obj_ud->ref = luaL_ref(L, LUA_REGISTRYINDEX);
     obj_ud->state = state;
+    obj_ud->stats_table = NULL;
 
     ref_id = g_dbus_connection_signal_subscribe(conn,
                                                 sender,
@@ -782,6 +1575,8 @@ static int bus_subscribe(lua_State *L)
                                                 signal_callback,
                                                 obj_ud,
                                                 object_ud_free);
+    g_hash_table_add(bus->subscriptions, GUINT_TO_POINTER(ref_id));
+    bus_anchor(L, bus, 1);
 
     lua_pushinteger(L, ref_id);
     return 1;
@@ -789,18 +1584,485 @@ static int bus_subscribe(lua_State *L)
 
 static int bus_unsubscribe(lua_State *L)
 {
-    GDBusConnection *conn = get_conn(L, 1);
+    struct easydbus_conn *bus = check_bus(L, 1);
     guint ref_id = luaL_checkinteger(L, 2);
 
-    g_debug("%s", __FUNCTION__);
+    ed_debug("%s", __FUNCTION__);
+
+    g_dbus_connection_signal_unsubscribe(bus->conn, ref_id);
+    g_hash_table_remove(bus->subscriptions, GUINT_TO_POINTER(ref_id));
+    bus_anchor(L, bus, 1);
+
+    return 0;
+}
+
+/* Drops everything registered through this bus object */
+static void bus_release(lua_State *L, struct easydbus_conn *bus)
+{
+    GHashTableIter iter;
+    gpointer id;
+
+    if (!bus->conn)
+        return;
+
+    ed_debug("%s: conn=%p", __FUNCTION__, (void *) bus->conn);
+
+    g_hash_table_iter_init(&iter, bus->objects);
+    while (g_hash_table_iter_next(&iter, &id, NULL))
+        g_dbus_connection_unregister_object(bus->conn, GPOINTER_TO_UINT(id));
+
+    g_hash_table_iter_init(&iter, bus->subscriptions);
+    while (g_hash_table_iter_next(&iter, &id, NULL))
+        g_dbus_connection_signal_unsubscribe(bus->conn, GPOINTER_TO_UINT(id));
+
+    /* Names are released by destroying bus->names */
+    g_hash_table_iter_init(&iter, bus->watches);
+    while (g_hash_table_iter_next(&iter, &id, NULL))
+        g_bus_unwatch_name(GPOINTER_TO_UINT(id));
+
+    g_hash_table_destroy(bus->objects);
+    g_hash_table_destroy(bus->subscriptions);
+    g_hash_table_destroy(bus->names);
+    g_hash_table_unref(bus->client_stats);
+    g_hash_table_unref(bus->server_stats);
+    g_hash_table_destroy(bus->coalesce);
+    g_hash_table_unref(bus->inflight);
+    g_hash_table_destroy(bus->watches);
+    g_hash_table_destroy(bus->routes);
+
+    if (bus->capture) {
+        capture_stop(bus->capture);
+        bus->capture = NULL;
+    }
+
+    if (bus->closed_id)
+        g_signal_handler_disconnect(bus->conn, bus->closed_id);
+
+    if (bus->close_on_release)
+        g_dbus_connection_close(bus->conn, NULL, NULL, NULL);
+
+    /* Drop anchor of bus_anchor() */
+    lua_pushlightuserdata(L, bus);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* Next push_conn() of this connection creates a fresh bus object */
+    lua_pushlightuserdata(L, BUS_CACHE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, bus->conn);
+    lua_rawget(L, -2);
+    if (lua_touserdata(L, -1) == bus) {
+        lua_pushlightuserdata(L, bus->conn);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+
+    /* Peer connections accepted by server are anchored in registry */
+    lua_pushlightuserdata(L, bus->conn);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    g_object_unref(bus->conn);
+    bus->conn = NULL;
+}
+
+static int bus_close(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+
+    bus_release(L, bus);
+
+    return 0;
+}
+
+static int bus__gc(lua_State *L)
+{
+    struct easydbus_conn *bus = lua_touserdata(L, 1);
 
-    g_dbus_connection_signal_unsubscribe(conn, ref_id);
+    bus_release(L, bus);
 
     return 0;
 }
 
+static int bus_memory(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    guint n_objects = g_hash_table_size(bus->objects);
+    guint n_subscriptions = g_hash_table_size(bus->subscriptions);
+    guint n_names = g_hash_table_size(bus->names);
+    gsize bytes;
+
+    /*
+     * Rough estimate of registration bookkeeping only; stats, routes,
+     * in-flight calls, outgoing queue and capture are not counted.
+     */
+    bytes = sizeof(*bus) +
+        (n_objects + n_subscriptions) * sizeof(struct object_ud) +
+        n_names * sizeof(struct owned_name) +
+        (n_objects + n_subscriptions + n_names) * (2 * sizeof(gpointer) + sizeof(guint));
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, n_objects);
+    lua_setfield(L, -2, "objects");
+    lua_pushinteger(L, n_subscriptions);
+    lua_setfield(L, -2, "subscriptions");
+    lua_pushinteger(L, n_names);
+    lua_setfield(L, -2, "names");
+    lua_pushinteger(L, bus->pending_calls);
+    lua_setfield(L, -2, "pending_calls");
+    lua_pushinteger(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    /* Whole Lua heap, not share of this bus object */
+    lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0));
+    lua_setfield(L, -2, "lua_bytes");
+
+    return 1;
+}
+
+/*
+ * Returns per method statistics of outgoing (client) and incoming (server)
+ * calls, keyed by "interface.method".
+ */
+static int bus_stats(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+
+    lua_createtable(L, 0, 2);
+    push_stats_table(L, bus->client_stats);
+    lua_setfield(L, -2, "client");
+    push_stats_table(L, bus->server_stats);
+    lua_setfield(L, -2, "server");
+
+    return 1;
+}
+
+static void flush_callback(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    lua_State *T = user_data;
+    GError *error = NULL;
+
+    if (g_dbus_connection_flush_finish(G_DBUS_CONNECTION(source), res, &error)) {
+        lua_pushboolean(T, 1);
+        ed_resume(T, 2);
+    } else {
+        lua_pushnil(T);
+        lua_pushstring(T, error->message);
+        ed_resume(T, 3);
+        g_error_free(error);
+    }
+
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+}
+
+/*
+ * Returns true once all queued outgoing messages are written.
+ *
+ * Args:
+ * 1) conn
+ * 2) callback
+ * 3) callback_arg
+ */
+static int bus_flush(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    struct easydbus_conn *bus = check_bus(L, 1);
+    GError *error = NULL;
+    lua_State *T;
+
+    if (!in_mainloop(state)) {
+        if (!g_dbus_connection_flush_sync(bus->conn, NULL, &error)) {
+            lua_pushnil(L);
+            lua_pushstring(L, error->message);
+            g_error_free(error);
+            return 2;
+        }
+
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 3);
+
+    /* Thread stack: bus, callback, callback_arg */
+    T = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_xmove(L, T, 3);
+
+    lua_pushlightuserdata(L, T);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    g_dbus_connection_flush(bus->conn, NULL, flush_callback, T);
+
+    return 0;
+}
+
+/*
+ * Returns gauge of signals and async calls waiting in outgoing queue:
+ * { messages, bytes (of message bodies), max_messages, max_bytes,
+ *   high_water_messages, high_water_bytes, wait }
+ */
+static int bus_queue_stats(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+
+    push_outgoing_queue(L, bus->queue);
+    return 1;
+}
+
+/*
+ * Makes emit() fail with "Outgoing queue full" while queue holds at least
+ * bytes or messages (0 or nil disables either limit). With wait set,
+ * emit() flushes queue and retries instead.
+ */
+static int bus_set_high_water(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    lua_Integer bytes = luaL_optinteger(L, 2, 0);
+    lua_Integer messages = luaL_optinteger(L, 3, 0);
+
+    luaL_argcheck(L, bytes >= 0, 2, "Invalid byte limit");
+    luaL_argcheck(L, messages >= 0, 3, "Invalid message limit");
+
+    outgoing_queue_set_high_water(bus->queue, bytes, messages, lua_toboolean(L, 4));
+    return 0;
+}
+
+static void watch_callback(struct object_ud *obj_ud, int handler, const gchar *name, const gchar *name_owner)
+{
+    struct easydbus_state *state = obj_ud->state;
+    lua_State *L = lua_newthread(state->L);
+    int n_args;
+    int ret;
+    int i;
+
+    /* Handlers table: appeared, vanished, args ... */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, obj_ud->ref);
+    lua_rawgeti(L, 1, handler);
+    if (lua_isnil(L, -1)) {
+        lua_pop(state->L, 1);
+        return;
+    }
+
+    lua_getfield(L, 1, "n");
+    n_args = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    for (i = 3; i <= n_args; i++)
+        lua_rawgeti(L, 1, i);
+    lua_remove(L, 1);
+
+    lua_pushstring(L, name);
+    if (name_owner)
+        lua_pushstring(L, name_owner);
+
+    ret = ed_resume(L, n_args - 2 + (name_owner ? 2 : 1));
+    if (ret && ret != LUA_YIELD)
+        g_warning("name watch handler error: %s", lua_tostring(L, -1));
+
+    lua_pop(state->L, 1);
+}
+
+static void name_appeared(GDBusConnection *conn, const gchar *name, const gchar *name_owner, gpointer user_data)
+{
+    watch_callback(user_data, 1, name, name_owner);
+}
+
+static void name_vanished(GDBusConnection *conn, const gchar *name, gpointer user_data)
+{
+    watch_callback(user_data, 2, name, NULL);
+}
+
+/*
+ * Calls on_appeared(args..., name, owner) whenever name gets an owner and
+ * on_vanished(args..., name) when it loses it. Either handler can be nil.
+ *
+ * Args:
+ * 1) conn
+ * 2) name
+ * 3) on_appeared
+ * 4) on_vanished
+ * 5) args ...
+ */
+static int bus_watch_name(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    struct easydbus_conn *bus = check_bus(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    int n_args = lua_gettop(L);
+    struct object_ud *obj_ud;
+    guint watch_id;
+    int i;
+
+    luaL_argcheck(L, g_dbus_is_name(name), 2, "Invalid bus name");
+    luaL_argcheck(L, !lua_isnoneornil(L, 3) || !lua_isnoneornil(L, 4), 3, "Name watch handler not specified");
+
+    lua_createtable(L, n_args - 2, 1);
+    for (i = 3; i <= n_args; i++) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i - 2);
+    }
+    lua_pushinteger(L, n_args < 4 ? 2 : n_args - 2);
+    lua_setfield(L, -2, "n");
+
+    obj_ud = g_new(struct object_ud, 1);
+    obj_ud->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    obj_ud->state = state;
+    obj_ud->stats_table = NULL;
+
+    watch_id = g_bus_watch_name_on_connection(bus->conn, name, G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                              name_appeared, name_vanished, obj_ud, object_ud_free);
+    g_hash_table_add(bus->watches, GUINT_TO_POINTER(watch_id));
+    bus_anchor(L, bus, 1);
+
+    lua_pushinteger(L, watch_id);
+    return 1;
+}
+
+static int bus_unwatch_name(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    guint watch_id = luaL_checkinteger(L, 2);
+
+    if (g_hash_table_remove(bus->watches, GUINT_TO_POINTER(watch_id)))
+        g_bus_unwatch_name(watch_id);
+    bus_anchor(L, bus, 1);
+
+    return 0;
+}
+
+/*
+ * Resolves well-known name to its unique owner and sends calls to the
+ * latter from now on. Calls to name without owner fail immediately.
+ */
+static int bus_route(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    struct route *route;
+
+    luaL_argcheck(L, g_dbus_is_name(name) && !g_dbus_is_unique_name(name), 2, "Invalid well-known name");
+
+    if (g_hash_table_contains(bus->routes, name))
+        return 0;
+
+    route = g_new0(struct route, 1);
+    route->watch_id = g_bus_watch_name_on_connection(bus->conn, name, G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                     route_appeared, route_vanished, route, route_free);
+    g_hash_table_insert(bus->routes, g_strdup(name), route);
+    g_hash_table_add(bus->watches, GUINT_TO_POINTER(route->watch_id));
+    bus_anchor(L, bus, 1);
+
+    return 0;
+}
+
+static int bus_unroute(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    struct route *route = g_hash_table_lookup(bus->routes, name);
+    guint watch_id;
+
+    if (!route)
+        return 0;
+
+    /* Route is freed by unwatching */
+    watch_id = route->watch_id;
+    g_hash_table_remove(bus->routes, name);
+    g_hash_table_remove(bus->watches, GUINT_TO_POINTER(watch_id));
+    g_bus_unwatch_name(watch_id);
+    bus_anchor(L, bus, 1);
+
+    return 0;
+}
+
+/*
+ * Enables (or disables if third argument is false) coalescing of calls to
+ * method: while call is in flight, identical calls (same destination, path
+ * and parameters) made inside mainloop are not sent, but get the same reply.
+ */
+static int bus_coalesce(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    const char *interface_name = luaL_checkstring(L, 2);
+    const char *method_name = luaL_checkstring(L, 3);
+    gchar *name = g_strconcat(interface_name, ".", method_name, NULL);
+
+    if (lua_isnone(L, 4) || lua_toboolean(L, 4)) {
+        g_hash_table_add(bus->coalesce, name);
+    } else {
+        g_hash_table_remove(bus->coalesce, name);
+        g_free(name);
+    }
+
+    return 0;
+}
+
+static int bus_reset_stats(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+
+    stats_table_reset(bus->client_stats);
+    stats_table_reset(bus->server_stats);
+
+    return 0;
+}
+
+/*
+ * Writes all incoming and outgoing messages of this connection to pcap file
+ * (D-Bus link type), from a separate thread.
+ */
+static int bus_capture_start(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    GError *error = NULL;
+
+    if (bus->capture) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Capture already started");
+        return 2;
+    }
+
+    bus->capture = capture_start(bus->conn, path, &error);
+    if (!bus->capture) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Returns number of captured messages */
+static int bus_capture_stop(lua_State *L)
+{
+    struct easydbus_conn *bus = check_bus(L, 1);
+
+    if (!bus->capture) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Capture not started");
+        return 2;
+    }
+
+    lua_pushinteger(L, capture_stop(bus->capture));
+    bus->capture = NULL;
+
+    return 1;
+}
+
 luaL_Reg bus_funcs[] = {
     {"call", bus_call},
+    {"call_json", bus_call_json},
+    {"call_blob", bus_call_blob},
     {"introspect", bus_introspect},
     {"register_object", bus_register_object},
     {"unregister_object", bus_unregister_object},
@@ -809,32 +2071,222 @@ luaL_Reg bus_funcs[] = {
     {"emit", bus_emit},
     {"subscribe", bus_subscribe},
     {"unsubscribe", bus_unsubscribe},
+    {"close", bus_close},
+    {"memory", bus_memory},
+    {"stats", bus_stats},
+    {"reset_stats", bus_reset_stats},
+    {"coalesce", bus_coalesce},
+    {"watch_name", bus_watch_name},
+    {"unwatch_name", bus_unwatch_name},
+    {"route", bus_route},
+    {"unroute", bus_unroute},
+    {"flush", bus_flush},
+    {"queue_stats", bus_queue_stats},
+    {"set_high_water", bus_set_high_water},
+    {"capture_start", bus_capture_start},
+    {"capture_stop", bus_capture_stop},
+    {"__gc", bus__gc},
     {NULL, NULL},
 };
 
-int new_conn(lua_State *L, GBusType bus_type)
+/*
+ * Takes ownership of conn reference. Pushes the bus object already created
+ * for conn if there is one, so registrations on shared connections are not
+ * tied to a transient handle.
+ */
+int push_conn(lua_State *L, struct easydbus_state *state, GDBusConnection *conn, gboolean close_on_release)
 {
-    GError *error = NULL;
-    GDBusConnection *conn;
-
-    conn = g_bus_get_sync(bus_type, NULL, &error);
-    g_assert_no_error(error);
-
-    lua_createtable(L, 1, 0);
+    struct easydbus_conn *bus;
 
+    lua_pushlightuserdata(L, BUS_CACHE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
     lua_pushlightuserdata(L, conn);
-    lua_rawseti(L, -2, 1);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        g_object_unref(conn);
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    bus = lua_newuserdata(L, sizeof(*bus));
+    bus->state = state;
+    bus->conn = conn;
+    bus->close_on_release = close_on_release;
+    bus->objects = g_hash_table_new(NULL, NULL);
+    bus->subscriptions = g_hash_table_new(NULL, NULL);
+    bus->names = g_hash_table_new_full(NULL, NULL, NULL, owned_name_free);
+    bus->next_name_id = 0;
+    bus->pending_calls = 0;
+    bus->client_stats = stats_table_new();
+    bus->server_stats = stats_table_new();
+    bus->capture = NULL;
+    bus->coalesce = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    bus->inflight = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref,
+                                          (GDestroyNotify) g_ptr_array_unref);
+    bus->watches = g_hash_table_new(NULL, NULL);
+    bus->routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    bus->queue = outgoing_queue_get(conn);
+    bus->closed_id = 0;
 
     lua_pushlightuserdata(L, BUS_MT);
     lua_rawget(L, LUA_REGISTRYINDEX);
 
     lua_setmetatable(L, -2);
 
-    g_debug("Created conn=%p", (void *) conn);
+    /* cache[conn] = bus */
+    lua_pushlightuserdata(L, conn);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+
+    ed_debug("Created conn=%p", (void *) conn);
 
     return 1;
 }
 
+struct conn_ud {
+    struct easydbus_state *state;
+    lua_State *T;
+    gboolean close_on_release;
+};
+
+static void conn_ready(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    struct conn_ud *conn_ud = user_data;
+    lua_State *T = conn_ud->T;
+    GDBusConnection *conn;
+    GError *error = NULL;
+
+    if (conn_ud->close_on_release)
+        conn = g_dbus_connection_new_for_address_finish(res, &error);
+    else
+        conn = g_bus_get_finish(res, &error);
+
+    ed_debug("%s: conn=%p", __FUNCTION__, (void *) conn);
+
+    if (conn) {
+        push_conn(T, conn_ud->state, conn, conn_ud->close_on_release);
+        ed_resume(T, 2);
+    } else {
+        lua_pushnil(T);
+        lua_pushstring(T, error->message);
+        g_error_free(error);
+        ed_resume(T, 3);
+    }
+
+    /* Remove thread from registry, so garbage collection can take place */
+    lua_pushlightuserdata(T, T);
+    lua_pushnil(T);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+
+    g_free(conn_ud);
+}
+
+/*
+ * Returns NULL if connection should be created synchronously, otherwise
+ * prepares thread with callback and callback argument from cb_index.
+ */
+static struct conn_ud *new_conn_ud(lua_State *L, struct easydbus_state *state, int cb_index,
+                                   gboolean close_on_release)
+{
+    struct conn_ud *conn_ud;
+
+    if (!in_mainloop(state) || cb_index < 1 || !lua_isfunction(L, cb_index))
+        return NULL;
+
+    conn_ud = g_new(struct conn_ud, 1);
+    conn_ud->state = state;
+    conn_ud->close_on_release = close_on_release;
+    conn_ud->T = lua_newthread(L);
+
+    lua_pushvalue(L, cb_index);
+    lua_pushvalue(L, cb_index + 1);
+    lua_xmove(L, conn_ud->T, 2);
+
+    /* Push thread to registry so we will prevent garbage collection */
+    lua_pushlightuserdata(L, conn_ud->T);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    return conn_ud;
+}
+
+/*
+ * Args:
+ * cb_index) callback (only inside mainloop, optional)
+ * cb_index+1) callback_arg
+ */
+int new_conn(lua_State *L, struct easydbus_state *state, GBusType bus_type, int cb_index)
+{
+    GError *error = NULL;
+    GDBusConnection *conn;
+    struct conn_ud *conn_ud;
+
+    conn_ud = new_conn_ud(L, state, cb_index, FALSE);
+    if (conn_ud) {
+        g_bus_get(bus_type, NULL, conn_ready, conn_ud);
+        return 0;
+    }
+
+    conn = g_bus_get_sync(bus_type, NULL, &error);
+    if (!conn) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    return push_conn(L, state, conn, FALSE);
+}
+
+int new_private_conn(lua_State *L, struct easydbus_state *state, const char *address, gboolean message_bus,
+                     int cb_index)
+{
+    GError *error = NULL;
+    GDBusConnection *conn;
+    GDBusConnectionFlags flags = G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT;
+    struct conn_ud *conn_ud;
+    gchar *bus_address;
+
+    if (g_strcmp0(address, "session") == 0)
+        bus_address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    else if (g_strcmp0(address, "system") == 0)
+        bus_address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+    else
+        bus_address = g_strdup(address);
+
+    if (!bus_address) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    if (message_bus)
+        flags |= G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION;
+
+    conn_ud = new_conn_ud(L, state, cb_index, TRUE);
+    if (conn_ud) {
+        g_dbus_connection_new_for_address(bus_address, flags, NULL, NULL, conn_ready, conn_ud);
+        g_free(bus_address);
+        return 0;
+    }
+
+    conn = g_dbus_connection_new_for_address_sync(bus_address, flags, NULL, NULL, &error);
+    g_free(bus_address);
+
+    if (!conn) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    return push_conn(L, state, conn, TRUE);
+}
+
 int luaopen_easydbus_bus(lua_State *L)
 {
     /* Set bus mt */
@@ -850,5 +2302,21 @@ int luaopen_easydbus_bus(lua_State *L)
     lua_pushvalue(L, -2);
     lua_rawset(L, LUA_REGISTRYINDEX);
 
+    /* Set invocation mt in registry */
+    lua_pushlightuserdata(L, INVOCATION_MT);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, method_invocation__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* Set weak bus cache in registry */
+    lua_pushlightuserdata(L, BUS_CACHE);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     return 1;
 }
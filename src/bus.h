@@ -12,6 +12,31 @@
 
 #include <gio/gio.h>
 
-int new_conn(lua_State *L, GBusType bus_type);
+#include "easydbus.h"
+
+struct easydbus_conn {
+    struct easydbus_state *state;
+    GDBusConnection *conn;
+    gboolean close_on_release;
+    GHashTable *objects;
+    GHashTable *subscriptions;
+    GHashTable *names;
+    guint next_name_id;
+    gint pending_calls;
+    GHashTable *client_stats;
+    GHashTable *server_stats;
+    struct capture *capture;
+    GHashTable *coalesce;
+    GHashTable *inflight;
+    GHashTable *watches;
+    GHashTable *routes;
+    struct outgoing_queue *queue;
+    gulong closed_id;
+};
+
+int push_conn(lua_State *L, struct easydbus_state *state, GDBusConnection *conn, gboolean close_on_release);
+int new_conn(lua_State *L, struct easydbus_state *state, GBusType bus_type, int cb_index);
+int new_private_conn(lua_State *L, struct easydbus_state *state, const char *address, gboolean message_bus,
+                     int cb_index);
 
 int luaopen_easydbus_bus(lua_State *L);
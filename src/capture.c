@@ -0,0 +1,219 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "capture.h"
+#include "filter.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Written as pcapng, which unlike pcap stores direction of each packet, so
+ * replay can tell outgoing calls from incoming ones on peer connections.
+ */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_SNAPLEN (128 * 1024 * 1024) /* max D-Bus message size */
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_INBOUND 1
+#define PCAPNG_OUTBOUND 2
+#define LINKTYPE_DBUS 231
+
+struct pcapng_header {
+    /* Section header block */
+    uint32_t shb_type;
+    uint32_t shb_length;
+    uint32_t byte_order_magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int64_t section_length;
+    uint32_t shb_length_end;
+    /* Interface description block, timestamps in default us resolution */
+    uint32_t idb_type;
+    uint32_t idb_length;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint32_t idb_length_end;
+} __attribute__((packed));
+
+/* Enhanced packet block, followed by data padded to 4 bytes and trailer */
+struct pcapng_epb_header {
+    uint32_t type;
+    uint32_t length;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t captured_length;
+    uint32_t original_length;
+};
+
+struct pcapng_epb_trailer {
+    uint16_t flags_code;
+    uint16_t flags_length;
+    uint32_t flags;
+    uint32_t end_of_options;
+    uint32_t length;
+};
+
+/* Message queued for writer thread, blob == NULL stops it */
+struct capture_record {
+    gint64 time;
+    guchar *blob;
+    gsize size;
+    gboolean incoming;
+};
+
+struct capture {
+    struct conn_filter filter;
+    GAsyncQueue *queue;
+    GThread *thread;
+    FILE *file;
+    guint64 n_records;
+};
+
+static void capture_record_free(gpointer data)
+{
+    struct capture_record *record = data;
+
+    g_free(record->blob);
+    g_free(record);
+}
+
+static void capture_free(gpointer data)
+{
+    struct capture *capture = data;
+
+    g_async_queue_unref(capture->queue);
+    g_free(capture);
+}
+
+static gpointer capture_writer(gpointer data)
+{
+    struct capture *capture = data;
+    static const guchar padding[3];
+    struct capture_record *record;
+    struct pcapng_epb_header header;
+    struct pcapng_epb_trailer trailer;
+    gsize pad;
+
+    while ((record = g_async_queue_pop(capture->queue))->blob) {
+        pad = (4 - record->size % 4) % 4;
+
+        header.type = PCAPNG_EPB;
+        header.length = sizeof(header) + record->size + pad + sizeof(trailer);
+        header.interface_id = 0;
+        header.ts_high = (guint64) record->time >> 32;
+        header.ts_low = (guint64) record->time & 0xffffffff;
+        header.captured_length = record->size;
+        header.original_length = record->size;
+
+        trailer.flags_code = PCAPNG_OPT_EPB_FLAGS;
+        trailer.flags_length = sizeof(trailer.flags);
+        trailer.flags = record->incoming ? PCAPNG_INBOUND : PCAPNG_OUTBOUND;
+        trailer.end_of_options = 0;
+        trailer.length = header.length;
+
+        if (fwrite(&header, sizeof(header), 1, capture->file) != 1 ||
+            fwrite(record->blob, record->size, 1, capture->file) != 1 ||
+            (pad && fwrite(padding, pad, 1, capture->file) != 1) ||
+            fwrite(&trailer, sizeof(trailer), 1, capture->file) != 1)
+            g_warning("Failed to write capture: %s", g_strerror(errno));
+        else
+            capture->n_records++;
+
+        capture_record_free(record);
+    }
+
+    capture_record_free(record);
+
+    return NULL;
+}
+
+/* Called from GDBus worker thread for incoming and outgoing messages */
+static GDBusMessage *capture_filter(GDBusConnection *conn, GDBusMessage *message,
+                                    gboolean incoming, gpointer user_data)
+{
+    struct capture *capture = user_data;
+    struct capture_record *record = g_new(struct capture_record, 1);
+
+    record->time = g_get_real_time();
+    record->incoming = incoming;
+    record->blob = g_dbus_message_to_blob(message, &record->size, G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING, NULL);
+
+    if (!record->blob) {
+        g_free(record);
+        return message;
+    }
+
+    g_async_queue_push(capture->queue, record);
+
+    return message;
+}
+
+struct capture *capture_start(GDBusConnection *conn, const char *path, GError **error)
+{
+    struct capture *capture;
+    struct pcapng_header header = {
+        .shb_type = PCAPNG_SHB,
+        .shb_length = 28,
+        .byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC,
+        .version_major = 1,
+        .version_minor = 0,
+        .section_length = -1,
+        .shb_length_end = 28,
+        .idb_type = PCAPNG_IDB,
+        .idb_length = 20,
+        .linktype = LINKTYPE_DBUS,
+        .snaplen = PCAPNG_SNAPLEN,
+        .idb_length_end = 20,
+    };
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Failed to open %s: %s", path, g_strerror(errno));
+        return NULL;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Failed to write %s: %s", path, g_strerror(errno));
+        fclose(file);
+        return NULL;
+    }
+
+    capture = g_new0(struct capture, 1);
+    capture->file = file;
+    capture->queue = g_async_queue_new_full(capture_record_free);
+    capture->thread = g_thread_new("easydbus-capture", capture_writer, capture);
+    conn_filter_add(&capture->filter, conn, capture_filter, capture_free);
+
+    return capture;
+}
+
+/* Returns number of captured messages, which are all on disk once it returns */
+guint64 capture_stop(struct capture *capture)
+{
+    guint64 n_records;
+
+    conn_filter_remove(&capture->filter);
+
+    /* Messages racing with filter removal may be left in queue */
+    g_async_queue_push(capture->queue, g_new0(struct capture_record, 1));
+    g_thread_join(capture->thread);
+
+    fclose(capture->file);
+    n_records = capture->n_records;
+
+    conn_filter_unref(capture);
+
+    return n_records;
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+struct capture;
+
+struct capture *capture_start(GDBusConnection *conn, const char *path, GError **error);
+guint64 capture_stop(struct capture *capture);
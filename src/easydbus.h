@@ -12,6 +12,22 @@
 
 #include <gio/gio.h>
 
+/*
+ * Debug logging from hot paths, compiled out unless EASYDBUS_DEBUG_LOG is
+ * defined. Arguments are still type checked, but never evaluated.
+ */
+#ifdef EASYDBUS_DEBUG_LOG
+#define ed_debug(...) g_debug(__VA_ARGS__)
+#define ed_debug_args(L, first, last) debug_args(L, first, last)
+void debug_args(lua_State *L, int first, int last);
+#else
+#define ed_debug(...) do { if (0) g_debug(__VA_ARGS__); } while (0)
+#define ed_debug_args(L, first, last) do { } while (0)
+#endif
+
+/* Number of add_callback priority levels (high, default, low) */
+#define EASYDBUS_CB_PRIORITIES 3
+
 struct easydbus_state {
     GMainContext *context;
     GMainLoop *loop;
@@ -21,6 +37,19 @@ struct easydbus_state {
     gint max_priority;
     gint timeout;
     int ref_cb;
+    int epoll_fd;
+    int timer_fd;
+    GPollFD *epoll_fds;
+    gint epoll_nfds;
+    gint dispatch_budget;
+    gint64 dispatch_budget_us;
+    guint64 dispatch_rounds;
+    guint64 dispatch_budget_hits;
+    GQueue callbacks[EASYDBUS_CB_PRIORITIES];
+    guint callbacks_source;
+    gint callbacks_budget;
+    GHashTable *timers;  /* ids of pending add_timeout() sources */
+    gint blocking;  /* nesting depth of dbus.blocking() calls */
     lua_State *L;
 };
 
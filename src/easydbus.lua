@@ -11,30 +11,66 @@ local resume = coroutine.resume
 local running = coroutine.running
 local yield = coroutine.yield
 local unpack = unpack or table.unpack
+local pack = table.pack or dbus.pack
+
+-- Lua 5.1 returns nil from running() in the main thread, 5.2 returns true as
+-- second value
+local isyieldable = coroutine.isyieldable or function()
+   local co, main = running()
+   return co ~= nil and not main
+end
 
 -- wrappers
 local function task(func, ...)
+   local n = select('#', ...)
    local args = {...}
-   args[#args+1] = resume
-   args[#args+1] = running()
-   func(unpack(args))
+   args[n+1] = resume
+   args[n+2] = running()
+   return func(unpack(args, 1, n+2))
 end
 
-local old_mainloop = dbus.mainloop
-function dbus.mainloop(...)
-   local old_call = dbus.bus.call
-   dbus.bus.call = function(...)
-      return yield(task(old_call, ...))
+-- functions taking callback and callback argument as last arguments when
+-- run inside mainloop
+dbus.async = {
+   [dbus] = {'session', 'system', 'connect'},
+   [dbus.bus] = {'call', 'call_blob', 'call_json', 'flush', 'own_name'},
+}
+
+-- replaces async functions with wrapper(func), returns restore function;
+-- calls made outside of a coroutine still use the synchronous form
+function dbus.wrap_async(wrapper)
+   local old = {}
+   for tab, names in pairs(dbus.async) do
+      for _,name in ipairs(names) do
+         local func = tab[name]
+         local wrapped = wrapper(func)
+         old[#old+1] = {tab, name, func}
+         tab[name] = function(...)
+            if isyieldable() then
+               return wrapped(...)
+            end
+            return dbus.blocking(func, ...)
+         end
+      end
    end
-   local old_own_name = dbus.bus.own_name
-   dbus.bus.own_name = function(...)
-      return yield(task(old_own_name, ...))
+   return function()
+      for _,rec in ipairs(old) do
+         rec[1][rec[2]] = rec[3]
+      end
    end
+end
+
+local old_mainloop = dbus.mainloop
+function dbus.mainloop(...)
+   local restore = dbus.wrap_async(function(func)
+      return function(...)
+         return yield(task(func, ...))
+      end
+   end)
 
    local ret = {old_mainloop(...)}
 
-   dbus.bus.call = old_call
-   dbus.bus.own_name = old_own_name
+   restore()
 
    return unpack(ret)
 end
@@ -113,43 +149,252 @@ function dbus.bus:register_object(object)
    end
 end
 
+-- emit: with high water mark in wait mode, flush full outgoing queue (which
+-- yields inside mainloop) and retry
+local old_emit = dbus.bus.emit
+function dbus.bus:emit(...)
+   local ret, err = old_emit(self, ...)
+   while ret == nil and err == 'Outgoing queue full' and self:queue_stats().wait do
+      local ok, flush_err = self:flush()
+      if not ok then
+         return nil, flush_err
+      end
+      ret, err = old_emit(self, ...)
+   end
+   return ret, err
+end
+
 -- add_callback
+local function protect(func)
+   return function(...)
+      local status, err = xpcall(func, debug.traceback, ...)
+      if not status then
+         print(string.rep('#', 70))
+         print('Callback error!')
+         print(err)
+         print(string.rep('#', 70))
+      end
+   end
+end
+
 local old_add_callback = dbus.add_callback
 function dbus.add_callback(func, ...)
-   old_add_callback(
-      function(...)
-         local status, err = xpcall(func, debug.traceback, ...)
-         if not status then
-            print(string.rep('#', 70))
-            print('Callback error!')
-            print(err)
-            print(string.rep('#', 70))
-         end
-      end,
-      ...)
+   old_add_callback(protect(func), ...)
+end
+
+local old_add_priority_callback = dbus.add_priority_callback
+function dbus.add_priority_callback(priority, func, ...)
+   old_add_priority_callback(priority, protect(func), ...)
+end
+
+-- timers
+for _,name in ipairs({'add_timeout', 'add_interval', 'add_timeout_seconds', 'add_interval_seconds'}) do
+   local old_add_timer = dbus[name]
+   dbus[name] = function(interval, func, ...)
+      return old_add_timer(interval, protect(func), ...)
+   end
 end
 
 -- simpledbus-like proxy
 local proxy_mt = {}
 proxy_mt.__index = proxy_mt
 
-function proxy_mt.add_method(proxy, method_name, interface_name, sig)
+-- callers get their own copy of cached reply tables and buffers
+local buffer_mt = getmetatable(dbus.buffer(0))
+local function copy(value)
+   if getmetatable(value) == buffer_mt then
+      return dbus.buffer(value:tostring(), value:type())
+   end
+   if type(value) ~= 'table' then
+      return value
+   end
+   local ret = {}
+   for k,v in pairs(value) do
+      ret[k] = copy(v)
+   end
+   return setmetatable(ret, getmetatable(value))
+end
+
+local function copy_reply(reply)
+   local ret = {n = reply.n}
+   for i = 1, reply.n do
+      ret[i] = copy(reply[i])
+   end
+   return unpack(ret, 1, ret.n)
+end
+
+-- makes room for one more entry: drops expired ones, then oldest ones
+local function cache_evict(cache, now)
+   for key, entry in pairs(cache.entries) do
+      if entry.expires and entry.expires <= now then
+         cache.entries[key] = nil
+         cache.size = cache.size - 1
+      end
+   end
+   while cache.size >= cache.max_size do
+      local oldest_key, oldest
+      for key, entry in pairs(cache.entries) do
+         if not oldest or entry.seq < oldest.seq then
+            oldest_key, oldest = key, entry
+         end
+      end
+      if not oldest_key then
+         break
+      end
+      cache.entries[oldest_key] = nil
+      cache.size = cache.size - 1
+   end
+end
+
+-- types of arguments, which decide guessed signature: without it true and 1
+-- would serialize to the same key
+local math_type = math.type or function() return 'number' end
+local function guessed_types(...)
+   local types = {}
+   for i = 1, select('#', ...) do
+      local v = select(i, ...)
+      types[i] = type(v) == 'number' and math_type(v) or type(v)
+   end
+   return table.concat(types, ',') .. ';'
+end
+
+local function cached_method(proxy, method_name, interface_name, sig, opts)
+   local cache = {entries = {}, size = 0, max_size = opts.max_size or 256, generation = 0, seq = 0}
+   local ttl = opts.ttl and opts.ttl * 1000000
+   proxy._cache[method_name] = cache
+
+   if opts.invalidate then
+      cache.sub_id = proxy._bus:subscribe(proxy._service, nil, interface_name, opts.invalidate, function()
+         proxy:invalidate(method_name)
+      end)
+   end
+
+   return function(proxy, ...)
+      local key = dbus.serialize(sig, ...)
+      if not sig then
+         key = guessed_types(...) .. key
+      end
+      local entry = cache.entries[key]
+      if entry and (not entry.expires or entry.expires > dbus.monotonic_time()) then
+         return copy_reply(entry)
+      end
+
+      local generation = cache.generation
+      local ret = pack(proxy._bus:call(proxy._service, proxy._object_path, interface_name, method_name, sig, ...))
+      -- do not cache errors, nor replies invalidated while waiting for them
+      if not (ret.n == 2 and ret[1] == nil) and cache.generation == generation then
+         local now = dbus.monotonic_time()
+         if not cache.entries[key] then
+            if cache.size >= cache.max_size then
+               cache_evict(cache, now)
+            end
+            cache.size = cache.size + 1
+         end
+         -- insertion order, monotonic time may repeat
+         cache.seq = cache.seq + 1
+         ret.seq = cache.seq
+         ret.expires = ttl and now + ttl
+         cache.entries[key] = ret
+         return copy_reply(ret)
+      end
+      return unpack(ret, 1, ret.n)
+   end
+end
+
+-- drops cache of method together with its invalidation subscription
+local function remove_cache(proxy, method_name)
+   local cache = proxy._cache[method_name]
+   if cache then
+      if cache.sub_id then
+         proxy._bus:unsubscribe(cache.sub_id)
+      end
+      proxy._cache[method_name] = nil
+   end
+end
+
+-- cache: {ttl = seconds, invalidate = signal_name, max_size = n} keeps up to
+-- max_size (256 by default) replies in memory for ttl (forever if not set) or
+-- until signal is emitted by service
+function proxy_mt.add_method(proxy, method_name, interface_name, sig, cache)
    sig = sig or false
+   remove_cache(proxy, method_name)
+   if cache then
+      proxy[method_name] = cached_method(proxy, method_name, interface_name, sig, cache)
+      return
+   end
    proxy[method_name] = function(proxy, ...)
       return proxy._bus:call(proxy._service, proxy._object_path, interface_name, method_name, sig or false, ...)
    end
 end
 
-function dbus.bus:new_proxy(service, object_path)
+-- drops cached replies of method, or of all methods if not specified
+function proxy_mt.invalidate(proxy, method_name)
+   for name, cache in pairs(proxy._cache) do
+      if not method_name or name == method_name then
+         cache.entries = {}
+         cache.size = 0
+         cache.generation = cache.generation + 1
+      end
+   end
+end
+
+-- drops all cached replies and their invalidation subscriptions
+function proxy_mt.close(proxy)
+   for name in pairs(proxy._cache) do
+      remove_cache(proxy, name)
+   end
+end
+
+-- opts.route: send calls directly to unique name of service owner
+function dbus.bus:new_proxy(service, object_path, opts)
+   if opts and opts.route then
+      self:route(service)
+   end
    local proxy = {
       _bus = self,
       _service = service,
       _object_path = object_path,
+      _cache = {},
    }
    setmetatable(proxy, proxy_mt)
    return proxy
 end
 
+-- connection pool
+local pool_mt = {}
+pool_mt.__index = pool_mt
+
+function pool_mt:get()
+   local conn = self.conns[self.next]
+   self.next = self.next % #self.conns + 1
+   return conn
+end
+
+function pool_mt:call(...)
+   return self:get():call(...)
+end
+
+function pool_mt:emit(...)
+   return self:get():emit(...)
+end
+
+function dbus.pool(address, n, opts)
+   assert(type(n) == 'number' and n >= 1 and n % 1 == 0, 'Invalid number of connections')
+   local pool = {
+      conns = {},
+      next = 1,
+   }
+   for i = 1, n do
+      local conn, err = dbus.connect(address, opts)
+      if not conn then
+         return nil, err
+      end
+      pool.conns[i] = conn
+   end
+   setmetatable(pool, pool_mt)
+   return pool
+end
+
 -- simpledbus-like names
 dbus.SystemBus = dbus.system
 dbus.SessionBus = dbus.session
@@ -14,13 +14,19 @@
 #include <gio/gio.h>
 #include <glib-unix.h>
 
+#include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "buffer.h"
 #include "bus.h"
 #include "compat.h"
 #include "easydbus.h"
+#include "json.h"
 #include "poll.h"
+#include "serialize.h"
+#include "server.h"
+#include "trace.h"
 #include "utils.h"
 
 static int type_mt;
@@ -77,7 +83,7 @@ static gboolean on_signal(gpointer user_data)
 {
     struct easydbus_state *state = user_data;
 
-    g_debug("SIGINT/SIGTERM handler, exit program");
+    ed_debug("SIGINT/SIGTERM handler, exit program");
     if (state->loop)
         g_main_loop_quit(state->loop);
 
@@ -92,7 +98,7 @@ static int easydbus_handle_epoll(lua_State *L)
     int i;
     int n_args = lua_gettop(L);
 
-    g_debug("%s", __FUNCTION__);
+    ed_debug("%s", __FUNCTION__);
 
     gpoll_fds_clear(state);
 
@@ -123,14 +129,255 @@ static int easydbus_handle_epoll(lua_State *L)
     return 0;
 }
 
+static int easydbus_pollfd(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    int fd;
+
+    fd = epoll_mode_init(state);
+    if (fd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, g_strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, fd);
+    return 1;
+}
+
+/* Leaves single fd mode, so calls are synchronous again outside mainloop */
+static int easydbus_close_pollfd(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    epoll_mode_close(state);
+
+    return 0;
+}
+
+static int easydbus_dispatch(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    if (state->epoll_fd < 0)
+        return luaL_error(L, "pollfd() was not called");
+
+    epoll_mode_dispatch(state);
+
+    return 0;
+}
+
+/*
+ * Args:
+ * 1) max dispatch rounds per host loop iteration (0 - unlimited)
+ * 2) max time in microseconds per host loop iteration (0 - unlimited)
+ */
+static int easydbus_set_dispatch_budget(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    lua_Integer rounds = luaL_optinteger(L, 1, 0);
+    lua_Integer usec = luaL_optinteger(L, 2, 0);
+
+    luaL_argcheck(L, rounds >= 0 && rounds <= G_MAXINT, 1, "Invalid number of rounds");
+    luaL_argcheck(L, usec >= 0, 2, "Invalid time");
+
+    state->dispatch_budget = rounds;
+    state->dispatch_budget_us = usec;
+
+    return 0;
+}
+
+static int easydbus_dispatch_stats(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, state->dispatch_rounds);
+    lua_setfield(L, -2, "rounds");
+    lua_pushnumber(L, state->dispatch_budget_hits);
+    lua_setfield(L, -2, "budget_hits");
+
+    return 1;
+}
+
+static int easydbus_reset_dispatch_stats(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    state->dispatch_rounds = 0;
+    state->dispatch_budget_hits = 0;
+
+    return 0;
+}
+
+static int easydbus_marshal_stats(lua_State *L)
+{
+    push_marshal_stats(L);
+    return 1;
+}
+
+static int easydbus_set_marshal_stats(lua_State *L)
+{
+    marshal_stats_enable(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int easydbus_reset_marshal_stats(lua_State *L)
+{
+    marshal_stats_reset();
+    return 0;
+}
+
+/* Enables or disables recording to trace ring buffer */
+static int easydbus_trace(lua_State *L)
+{
+    trace_enabled = lua_toboolean(L, 1);
+    return 0;
+}
+
+static int easydbus_trace_dump(lua_State *L)
+{
+    push_trace(L);
+    return 1;
+}
+
+/* Monotonic time in microseconds */
+static int easydbus_monotonic_time(lua_State *L)
+{
+    lua_pushinteger(L, g_get_monotonic_time());
+    return 1;
+}
+
+/*
+ * Returns header fields of serialized D-Bus message:
+ * { type, serial, sender, destination, path, interface, member, signature }
+ */
+static int easydbus_message_info(lua_State *L)
+{
+    static const char *const types[] = {"invalid", "method_call", "method_return", "error", "signal"};
+    size_t size;
+    const char *blob = luaL_checklstring(L, 1, &size);
+    GError *error = NULL;
+    GDBusMessage *message;
+    guint type;
+
+    message = g_dbus_message_new_from_blob((guchar *) blob, size, G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING, &error);
+    if (!message) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    type = g_dbus_message_get_message_type(message);
+
+    lua_createtable(L, 0, 8);
+    lua_pushstring(L, type < G_N_ELEMENTS(types) ? types[type] : types[0]);
+    lua_setfield(L, -2, "type");
+    lua_pushinteger(L, g_dbus_message_get_serial(message));
+    lua_setfield(L, -2, "serial");
+    lua_pushstring(L, g_dbus_message_get_sender(message));
+    lua_setfield(L, -2, "sender");
+    lua_pushstring(L, g_dbus_message_get_destination(message));
+    lua_setfield(L, -2, "destination");
+    lua_pushstring(L, g_dbus_message_get_path(message));
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, g_dbus_message_get_interface(message));
+    lua_setfield(L, -2, "interface");
+    lua_pushstring(L, g_dbus_message_get_member(message));
+    lua_setfield(L, -2, "member");
+    lua_pushstring(L, g_dbus_message_get_signature(message));
+    lua_setfield(L, -2, "signature");
+
+    g_object_unref(message);
+
+    return 1;
+}
+
+/* Converts values to JSON array, as they would be sent with given signature */
+static int easydbus_to_json(lua_State *L)
+{
+    const char *sig = lua_tostring(L, 1);
+    GVariant *value = range_to_tuple(L, 2, lua_gettop(L) + 1, sig, NULL);
+    GString *str = g_string_sized_new(256);
+
+    g_variant_ref_sink(value);
+    append_json(str, value);
+    g_variant_unref(value);
+
+    lua_pushlstring(L, str->str, str->len);
+    g_string_free(str, TRUE);
+    return 1;
+}
+
+/* Converts JSON array to values of given signature */
+static int easydbus_from_json(lua_State *L)
+{
+    const char *sig = luaL_checkstring(L, 1);
+    const char *json = luaL_checkstring(L, 2);
+    GError *error = NULL;
+    GVariant *value;
+    gchar *tuple_sig;
+    int ret;
+
+    tuple_sig = g_strdup_printf("(%s)", sig);
+    if (!g_variant_type_string_is_valid(tuple_sig)) {
+        g_free(tuple_sig);
+        return luaL_argerror(L, 1, "Invalid signature");
+    }
+    value = json_to_variant(json, G_VARIANT_TYPE(tuple_sig), &error);
+    g_free(tuple_sig);
+    if (!value) {
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    g_variant_ref_sink(value);
+    ret = push_tuple(L, value, NULL);
+    g_variant_unref(value);
+    return ret;
+}
+
 static int easydbus_system(lua_State *L)
 {
-    return new_conn(L, G_BUS_TYPE_SYSTEM);
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    return new_conn(L, state, G_BUS_TYPE_SYSTEM, lua_gettop(L) - 1);
 }
 
 static int easydbus_session(lua_State *L)
 {
-    return new_conn(L, G_BUS_TYPE_SESSION);
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    return new_conn(L, state, G_BUS_TYPE_SESSION, lua_gettop(L) - 1);
+}
+
+/*
+ * Args:
+ * 1) address, "session" or "system"
+ * 2) options table (optional):
+ *    bus - address points to message bus daemon (default: true)
+ * last-1) callback (only inside mainloop)
+ * last) callback_arg
+ */
+static int easydbus_connect(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    const char *address = luaL_checkstring(L, 1);
+    gboolean message_bus = TRUE;
+
+    if (!lua_isnoneornil(L, 2) && !lua_isfunction(L, 2)) {
+        luaL_argcheck(L, lua_istable(L, 2), 2, "Is not a table");
+
+        lua_getfield(L, 2, "bus");
+        if (!lua_isnil(L, -1))
+            message_bus = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return new_private_conn(L, state, address, message_bus, lua_gettop(L) - 1);
 }
 
 /*
@@ -169,9 +416,9 @@ static int easydbus_mainloop(lua_State *L)
     sigint_id = g_unix_signal_add(SIGINT, on_signal, state);
     sigterm_id = g_unix_signal_add(SIGTERM, on_signal, state);
 
-    g_debug("Entering mainloop");
+    ed_debug("Entering mainloop");
     g_main_loop_run(state->loop);
-    g_debug("Exiting mainloop");
+    ed_debug("Exiting mainloop");
 
     g_source_remove(sigint_id);
     g_source_remove(sigterm_id);
@@ -198,58 +445,285 @@ static int easydbus_mainloop_quit(lua_State *L)
     return 2;
 }
 
-static gboolean add_callback(gpointer user_data)
+static const char *const callback_priorities[] = {"high", "default", "low", NULL};
+
+static void run_callback(struct easydbus_state *state, int ref)
 {
-    lua_State *T = user_data;
-    struct easydbus_state *state = lua_touserdata(T, 1);
-    int n_params = lua_gettop(T) - 2;
+    lua_State *T;
+    int n_args;
+    int i;
     int ret;
 
-    g_debug("add_callback");
+    T = lua_newthread(state->L);
+
+    /* Unpack callback with args */
+    lua_rawgeti(T, LUA_REGISTRYINDEX, ref);
+    lua_getfield(T, 1, "n");
+    n_args = lua_tointeger(T, -1);
+    lua_pop(T, 1);
+    for (i = 1; i <= n_args; i++)
+        lua_rawgeti(T, 1, i);
+    lua_remove(T, 1);
 
-    ret = ed_resume(T, n_params);
+    ret = ed_resume(T, n_args - 1);
     if (ret) {
         if (ret != LUA_YIELD)
             g_warning("Callback failed: %d, %s", ret, lua_tostring(T, -1));
         else
-            g_debug("Callback yielded");
+            ed_debug("Callback yielded");
     } else {
-        g_debug("Callback successfully resumed");
+        ed_debug("Callback successfully resumed");
+    }
+
+    lua_pop(state->L, 1);
+}
+
+static guint callbacks_pending(struct easydbus_state *state)
+{
+    guint n = 0;
+    int prio;
+
+    for (prio = 0; prio < EASYDBUS_CB_PRIORITIES; prio++)
+        n += g_queue_get_length(&state->callbacks[prio]);
+
+    return n;
+}
+
+static int callbacks_pop(struct easydbus_state *state)
+{
+    int prio;
+
+    for (prio = 0; prio < EASYDBUS_CB_PRIORITIES; prio++) {
+        if (!g_queue_is_empty(&state->callbacks[prio]))
+            return GPOINTER_TO_INT(g_queue_pop_head(&state->callbacks[prio]));
+    }
+
+    return LUA_NOREF;
+}
+
+/*
+ * Single idle source draining all queued callbacks. Callbacks queued while
+ * draining are left for the next round, so other sources are not starved.
+ */
+static gboolean run_callbacks(gpointer user_data)
+{
+    struct easydbus_state *state = user_data;
+    guint n = callbacks_pending(state);
+    int ref;
+
+    ed_debug("%s: pending=%u", __FUNCTION__, n);
+
+    if (state->callbacks_budget > 0 && n > (guint) state->callbacks_budget)
+        n = state->callbacks_budget;
+
+    while (n-- > 0 && (ref = callbacks_pop(state)) != LUA_NOREF) {
+        run_callback(state, ref);
+        luaL_unref(state->L, LUA_REGISTRYINDEX, ref);
     }
 
-    lua_pushlightuserdata(state->L, T);
-    lua_pushnil(state->L);
-    lua_rawset(state->L, LUA_REGISTRYINDEX);
+    if (callbacks_pending(state) > 0)
+        return G_SOURCE_CONTINUE;
 
-    return FALSE;
+    state->callbacks_source = 0;
+    return G_SOURCE_REMOVE;
 }
 
-static int easydbus_add_callback(lua_State *L)
+/* Packs callback with its args (index..top) into registry table */
+static int ref_callback(lua_State *L, int index)
 {
-    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
-    lua_State *T;
-    int n_args = lua_gettop(L);
+    int n_args = lua_gettop(L) - index + 1;
     int i;
 
-    T = lua_newthread(L);
+    luaL_argcheck(L, n_args > 0, index, "No callback specified");
+
+    lua_createtable(L, n_args, 1);
+    for (i = 0; i < n_args; i++) {
+        lua_pushvalue(L, index + i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, n_args);
+    lua_setfield(L, -2, "n");
 
-    lua_pushlightuserdata(L, state);
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
 
-    for (i = 1; i <= n_args; i++) {
-        lua_pushvalue(L, i);
+static void push_callback(lua_State *L, struct easydbus_state *state, int prio, int index)
+{
+    g_queue_push_tail(&state->callbacks[prio], GINT_TO_POINTER(ref_callback(L, index)));
+
+    if (!state->callbacks_source) {
+        state->callbacks_source = g_idle_add(run_callbacks, state);
+        /* Let external loop know about new source */
+        g_main_context_wakeup(state->context);
     }
-    lua_xmove(L, T, n_args + 1);
+}
 
-    lua_pushlightuserdata(L, T);
-    lua_pushvalue(L, -2);
-    lua_rawset(L, LUA_REGISTRYINDEX);
-    lua_pop(L, 1);
+static int easydbus_add_callback(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+
+    push_callback(L, state, 1, 1);
+
+    return 0;
+}
 
-    g_idle_add(add_callback, T);
+/*
+ * Args:
+ * 1) priority: "high", "default" or "low"
+ * 2) callback
+ * 3) callback args ...
+ */
+static int easydbus_add_priority_callback(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    int prio = luaL_checkoption(L, 1, "default", callback_priorities);
+
+    push_callback(L, state, prio, 2);
 
     return 0;
 }
 
+/*
+ * Args:
+ * 1) max number of callbacks run per mainloop iteration (0 - unlimited)
+ */
+static int easydbus_set_callback_budget(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    lua_Integer budget = luaL_checkinteger(L, 1);
+
+    luaL_argcheck(L, budget >= 0 && budget <= G_MAXINT, 1, "Invalid budget");
+
+    state->callbacks_budget = budget;
+
+    return 0;
+}
+
+struct timer_ud {
+    struct easydbus_state *state;
+    int ref;
+    gboolean repeat;
+    guint id;
+};
+
+static void timer_ud_free(gpointer user_data)
+{
+    struct timer_ud *timer_ud = user_data;
+
+    g_hash_table_remove(timer_ud->state->timers, GUINT_TO_POINTER(timer_ud->id));
+    luaL_unref(timer_ud->state->L, LUA_REGISTRYINDEX, timer_ud->ref);
+
+    g_free(timer_ud);
+}
+
+static gboolean timer_callback(gpointer user_data)
+{
+    struct timer_ud *timer_ud = user_data;
+
+    ed_debug("%s: ref=%d repeat=%d", __FUNCTION__, timer_ud->ref, (int) timer_ud->repeat);
+
+    run_callback(timer_ud->state, timer_ud->ref);
+
+    return timer_ud->repeat ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+/*
+ * Args:
+ * 1) interval (milliseconds or seconds)
+ * 2) callback
+ * 3) callback args ...
+ */
+static int add_timer(lua_State *L, gboolean repeat, gboolean seconds)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    lua_Integer interval = luaL_checkinteger(L, 1);
+    struct timer_ud *timer_ud;
+    guint id;
+
+    luaL_argcheck(L, interval >= 0 && interval <= G_MAXUINT, 1, "Invalid interval");
+
+    timer_ud = g_new(struct timer_ud, 1);
+    timer_ud->ref = ref_callback(L, 2);
+    timer_ud->state = state;
+    timer_ud->repeat = repeat;
+
+    /* Seconds granularity timers are coalesced by GLib to wake up together */
+    if (seconds)
+        id = g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, interval,
+                                        timer_callback, timer_ud, timer_ud_free);
+    else
+        id = g_timeout_add_full(G_PRIORITY_DEFAULT, interval,
+                                timer_callback, timer_ud, timer_ud_free);
+    timer_ud->id = id;
+    g_hash_table_add(state->timers, GUINT_TO_POINTER(id));
+
+    /* Let external loop know about new timeout */
+    g_main_context_wakeup(state->context);
+
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+static int easydbus_add_timeout(lua_State *L)
+{
+    return add_timer(L, FALSE, FALSE);
+}
+
+static int easydbus_add_interval(lua_State *L)
+{
+    return add_timer(L, TRUE, FALSE);
+}
+
+static int easydbus_add_timeout_seconds(lua_State *L)
+{
+    return add_timer(L, FALSE, TRUE);
+}
+
+static int easydbus_add_interval_seconds(lua_State *L)
+{
+    return add_timer(L, TRUE, TRUE);
+}
+
+static int easydbus_remove_timeout(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    guint id = luaL_checkinteger(L, 1);
+    gboolean pending;
+
+    /* Already fired timeouts are not an error, other sources are not ours */
+    pending = g_hash_table_contains(state->timers, GUINT_TO_POINTER(id));
+    if (pending)
+        g_source_remove(id);
+
+    lua_pushboolean(L, pending);
+    return 1;
+}
+
+/*
+ * Calls function with the synchronous form of async functions, even when
+ * running inside mainloop.
+ *
+ * Args:
+ * 1) function
+ * 2) args ... (optional)
+ */
+static int easydbus_blocking(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    int ret;
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    state->blocking++;
+    ret = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    state->blocking--;
+
+    if (ret)
+        return lua_error(L);
+
+    return lua_gettop(L);
+}
+
 static int easydbus_pack(lua_State *L)
 {
     int i;
@@ -266,11 +740,35 @@ static int easydbus_pack(lua_State *L)
 static luaL_Reg funcs[] = {
     {"system", easydbus_system},
     {"session", easydbus_session},
+    {"connect", easydbus_connect},
     {"handle_epoll", easydbus_handle_epoll},
     {"set_epoll_cb", easydbus_set_epoll_cb},
+    {"pollfd", easydbus_pollfd},
+    {"close_pollfd", easydbus_close_pollfd},
+    {"blocking", easydbus_blocking},
+    {"dispatch", easydbus_dispatch},
+    {"set_dispatch_budget", easydbus_set_dispatch_budget},
+    {"dispatch_stats", easydbus_dispatch_stats},
+    {"reset_dispatch_stats", easydbus_reset_dispatch_stats},
+    {"marshal_stats", easydbus_marshal_stats},
+    {"set_marshal_stats", easydbus_set_marshal_stats},
+    {"reset_marshal_stats", easydbus_reset_marshal_stats},
+    {"trace", easydbus_trace},
+    {"trace_dump", easydbus_trace_dump},
+    {"monotonic_time", easydbus_monotonic_time},
+    {"message_info", easydbus_message_info},
+    {"to_json", easydbus_to_json},
+    {"from_json", easydbus_from_json},
     {"mainloop", easydbus_mainloop},
     {"mainloop_quit", easydbus_mainloop_quit},
     {"add_callback", easydbus_add_callback}, /* only for internal mainloop */
+    {"add_priority_callback", easydbus_add_priority_callback},
+    {"set_callback_budget", easydbus_set_callback_budget},
+    {"add_timeout", easydbus_add_timeout},
+    {"add_interval", easydbus_add_interval},
+    {"add_timeout_seconds", easydbus_add_timeout_seconds},
+    {"add_interval_seconds", easydbus_add_interval_seconds},
+    {"remove_timeout", easydbus_remove_timeout},
     {"pack", easydbus_pack},
     {NULL, NULL},
 };
@@ -278,8 +776,25 @@ static luaL_Reg funcs[] = {
 static int easydbus_state__gc(lua_State *L)
 {
     struct easydbus_state *state = lua_touserdata(L, 1);
+    GList *ids, *l;
+    int ref;
+
+    ed_debug("%s %p", __FUNCTION__, (void *) state);
+    epoll_mode_close(state);
+
+    /* Callbacks of pending timers go away with Lua state */
+    ids = g_hash_table_get_keys(state->timers);
+    for (l = ids; l; l = l->next)
+        g_source_remove(GPOINTER_TO_UINT(l->data));
+    g_list_free(ids);
+    g_hash_table_destroy(state->timers);
+
+    /* So do queued callbacks, idle source must not outlive state */
+    if (state->callbacks_source)
+        g_source_remove(state->callbacks_source);
+    while ((ref = callbacks_pop(state)) != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
 
-    g_debug("%s %p", __FUNCTION__, (void *) state);
     g_main_context_release(state->context);
 
     return 0;
@@ -293,8 +808,9 @@ static luaL_Reg state_mt[] = {
 LUALIB_API int luaopen_easydbus_core(lua_State *L)
 {
     struct easydbus_state *state;
+    int i;
 
-    g_debug("PID: %d", (int) getpid());
+    ed_debug("PID: %d", (int) getpid());
 
     lua_settop(L, 0);
 
@@ -307,13 +823,27 @@ LUALIB_API int luaopen_easydbus_core(lua_State *L)
     luaL_newlibtable(L, state_mt);
     luaL_setfuncs(L, state_mt, 0);
     lua_setmetatable(L, -2);
-    g_debug("Created state: %p", (void *) state);
+    ed_debug("Created state: %p", (void *) state);
     state->context = g_main_context_default();
     state->loop = NULL;
     state->fds = NULL;
     state->allocated_nfds = 0;
     state->nfds = 0;
     state->ref_cb = -1;
+    state->epoll_fd = -1;
+    state->blocking = 0;
+    state->timer_fd = -1;
+    state->epoll_fds = NULL;
+    state->epoll_nfds = 0;
+    state->dispatch_budget = 0;
+    state->dispatch_budget_us = 0;
+    state->dispatch_rounds = 0;
+    state->dispatch_budget_hits = 0;
+    for (i = 0; i < EASYDBUS_CB_PRIORITIES; i++)
+        g_queue_init(&state->callbacks[i]);
+    state->callbacks_source = 0;
+    state->callbacks_budget = 0;
+    state->timers = g_hash_table_new(NULL, NULL);
     state->L = L;
 
     /* Set functions */
@@ -328,6 +858,27 @@ LUALIB_API int luaopen_easydbus_core(lua_State *L)
     lua_call(L, 1, 1);
     lua_rawset(L, 2);
 
+    /* Init buffer */
+    lua_pushliteral(L, "buffer");
+    lua_pushcfunction(L, luaopen_easydbus_buffer);
+    lua_pushvalue(L, 2);
+    lua_call(L, 1, 1);
+    lua_rawset(L, 2);
+
+    /* Init serialization */
+    lua_pushliteral(L, "snapshot");
+    lua_pushcfunction(L, luaopen_easydbus_serialize);
+    lua_pushvalue(L, 2);
+    lua_call(L, 1, 1);
+    lua_rawset(L, 2);
+
+    /* Init server */
+    lua_pushliteral(L, "server");
+    lua_pushcfunction(L, luaopen_easydbus_server);
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    lua_rawset(L, 2);
+
     /* Push type metatable */
     lua_pushliteral(L, "type");
     lua_newtable(L);
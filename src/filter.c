@@ -0,0 +1,34 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "filter.h"
+
+void conn_filter_unref(gpointer data)
+{
+    struct conn_filter *filter = data;
+
+    if (g_atomic_int_dec_and_test(&filter->ref))
+        filter->free_func(filter);
+}
+
+/*
+ * Referenced by owner and by connection, as filter may still run in GDBus
+ * worker thread after being removed.
+ */
+void conn_filter_add(struct conn_filter *filter, GDBusConnection *conn,
+                     GDBusMessageFilterFunction func, GDestroyNotify free_func)
+{
+    filter->ref = 2;
+    filter->conn = conn;
+    filter->free_func = free_func;
+    filter->id = g_dbus_connection_add_filter(conn, func, filter, conn_filter_unref);
+}
+
+/* Owner still holds its reference, drop it with conn_filter_unref() */
+void conn_filter_remove(struct conn_filter *filter)
+{
+    g_dbus_connection_remove_filter(filter->conn, filter->id);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+/*
+ * Connection filter with refcounted user data. It must be the first member
+ * of user data struct, which is passed to filter function and freed with
+ * free_func once both owner and connection dropped their references.
+ */
+struct conn_filter {
+    gint ref;
+    GDBusConnection *conn;
+    guint id;
+    GDestroyNotify free_func;
+};
+
+void conn_filter_add(struct conn_filter *filter, GDBusConnection *conn,
+                     GDBusMessageFilterFunction func, GDestroyNotify free_func);
+void conn_filter_remove(struct conn_filter *filter);
+void conn_filter_unref(gpointer data);
@@ -0,0 +1,667 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "json.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+/*
+ * GVariant -> JSON
+ *
+ * Dictionaries become objects (with non-string keys quoted), arrays and
+ * tuples become arrays, variants are unwrapped, 64-bit integers are written
+ * with full precision and non-finite doubles as null.
+ */
+
+static void append_json_string(GString *str, const char *s)
+{
+    g_string_append_c(str, '"');
+    for (; *s; s++) {
+        switch (*s) {
+        case '"':
+            g_string_append(str, "\\\"");
+            break;
+        case '\\':
+            g_string_append(str, "\\\\");
+            break;
+        case '\n':
+            g_string_append(str, "\\n");
+            break;
+        case '\r':
+            g_string_append(str, "\\r");
+            break;
+        case '\t':
+            g_string_append(str, "\\t");
+            break;
+        default:
+            if ((guchar) *s < 0x20)
+                g_string_append_printf(str, "\\u%04x", (guint) *s);
+            else
+                g_string_append_c(str, *s);
+        }
+    }
+    g_string_append_c(str, '"');
+}
+
+static void append_json_children(GString *str, GVariant *value)
+{
+    gsize i, n = g_variant_n_children(value);
+    GVariant *elem;
+
+    g_string_append_c(str, '[');
+    for (i = 0; i < n; i++) {
+        if (i)
+            g_string_append_c(str, ',');
+        elem = g_variant_get_child_value(value, i);
+        append_json(str, elem);
+        g_variant_unref(elem);
+    }
+    g_string_append_c(str, ']');
+}
+
+static void append_json_dict(GString *str, GVariant *value)
+{
+    gsize i, n = g_variant_n_children(value);
+    GVariant *entry, *key, *val;
+
+    g_string_append_c(str, '{');
+    for (i = 0; i < n; i++) {
+        if (i)
+            g_string_append_c(str, ',');
+
+        entry = g_variant_get_child_value(value, i);
+        key = g_variant_get_child_value(entry, 0);
+        val = g_variant_get_child_value(entry, 1);
+
+        if (g_variant_is_of_type(key, G_VARIANT_TYPE_STRING) ||
+            g_variant_is_of_type(key, G_VARIANT_TYPE_OBJECT_PATH) ||
+            g_variant_is_of_type(key, G_VARIANT_TYPE_SIGNATURE)) {
+            append_json_string(str, g_variant_get_string(key, NULL));
+        } else {
+            g_string_append_c(str, '"');
+            append_json(str, key);
+            g_string_append_c(str, '"');
+        }
+        g_string_append_c(str, ':');
+        append_json(str, val);
+
+        g_variant_unref(val);
+        g_variant_unref(key);
+        g_variant_unref(entry);
+    }
+    g_string_append_c(str, '}');
+}
+
+void append_json(GString *str, GVariant *value)
+{
+    GVariant *child;
+    gdouble d;
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    switch (g_variant_classify(value)) {
+    case G_VARIANT_CLASS_BOOLEAN:
+        g_string_append(str, g_variant_get_boolean(value) ? "true" : "false");
+        break;
+    case G_VARIANT_CLASS_BYTE:
+        g_string_append_printf(str, "%u", (guint) g_variant_get_byte(value));
+        break;
+    case G_VARIANT_CLASS_INT16:
+        g_string_append_printf(str, "%d", (gint) g_variant_get_int16(value));
+        break;
+    case G_VARIANT_CLASS_UINT16:
+        g_string_append_printf(str, "%u", (guint) g_variant_get_uint16(value));
+        break;
+    case G_VARIANT_CLASS_INT32:
+        g_string_append_printf(str, "%" G_GINT32_FORMAT, g_variant_get_int32(value));
+        break;
+    case G_VARIANT_CLASS_UINT32:
+        g_string_append_printf(str, "%" G_GUINT32_FORMAT, g_variant_get_uint32(value));
+        break;
+    case G_VARIANT_CLASS_INT64:
+        g_string_append_printf(str, "%" G_GINT64_FORMAT, g_variant_get_int64(value));
+        break;
+    case G_VARIANT_CLASS_UINT64:
+        g_string_append_printf(str, "%" G_GUINT64_FORMAT, g_variant_get_uint64(value));
+        break;
+    case G_VARIANT_CLASS_HANDLE:
+        g_string_append_printf(str, "%" G_GINT32_FORMAT, g_variant_get_handle(value));
+        break;
+    case G_VARIANT_CLASS_DOUBLE:
+        d = g_variant_get_double(value);
+        if (isfinite(d))
+            g_string_append(str, g_ascii_dtostr(buf, sizeof(buf), d));
+        else
+            g_string_append(str, "null");
+        break;
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+    case G_VARIANT_CLASS_SIGNATURE:
+        append_json_string(str, g_variant_get_string(value, NULL));
+        break;
+    case G_VARIANT_CLASS_VARIANT:
+        child = g_variant_get_variant(value);
+        append_json(str, child);
+        g_variant_unref(child);
+        break;
+    case G_VARIANT_CLASS_MAYBE:
+        if (g_variant_n_children(value)) {
+            child = g_variant_get_child_value(value, 0);
+            append_json(str, child);
+            g_variant_unref(child);
+        } else {
+            g_string_append(str, "null");
+        }
+        break;
+    case G_VARIANT_CLASS_ARRAY:
+        if (g_variant_get_type_string(value)[1] == '{')
+            append_json_dict(str, value);
+        else
+            append_json_children(str, value);
+        break;
+    case G_VARIANT_CLASS_TUPLE:
+    case G_VARIANT_CLASS_DICT_ENTRY:
+        append_json_children(str, value);
+        break;
+    }
+}
+
+/*
+ * JSON -> GVariant, guided by type. Values of 'v' type are guessed: strings,
+ * booleans, int32 (int64 if it does not fit), doubles, av arrays and a{sv}
+ * objects. Unix fd handles are not supported, as there is no fd list.
+ */
+
+/* Nested values deeper than that are rejected, so input can't exhaust C stack */
+#define JSON_MAX_DEPTH 64
+
+struct json_parser {
+    const char *start;
+    const char *p;
+    GError **error;
+    int depth;
+};
+
+static GVariant *parse_value(struct json_parser *parser, const GVariantType *type);
+
+static void parse_error(struct json_parser *parser, const char *message)
+{
+    if (*parser->error)
+        return;
+
+    g_set_error(parser->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid JSON at offset %d: %s",
+                (int) (parser->p - parser->start), message);
+}
+
+static void skip_ws(struct json_parser *parser)
+{
+    while (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' || *parser->p == '\r')
+        parser->p++;
+}
+
+static gboolean expect(struct json_parser *parser, char c)
+{
+    skip_ws(parser);
+    if (*parser->p != c) {
+        gchar message[] = "expected 'x'";
+
+        message[10] = c;
+        parse_error(parser, message);
+        return FALSE;
+    }
+    parser->p++;
+    return TRUE;
+}
+
+static gboolean accept(struct json_parser *parser, char c)
+{
+    skip_ws(parser);
+    if (*parser->p != c)
+        return FALSE;
+    parser->p++;
+    return TRUE;
+}
+
+static gboolean accept_word(struct json_parser *parser, const char *word)
+{
+    gsize len = strlen(word);
+
+    skip_ws(parser);
+    if (strncmp(parser->p, word, len) != 0)
+        return FALSE;
+    parser->p += len;
+    return TRUE;
+}
+
+static gboolean parse_hex4(struct json_parser *parser, gunichar *c)
+{
+    int i, digit;
+
+    *c = 0;
+    for (i = 0; i < 4; i++) {
+        digit = g_ascii_xdigit_value(parser->p[i]);
+        if (digit < 0) {
+            parse_error(parser, "invalid \\u escape");
+            return FALSE;
+        }
+        *c = (*c << 4) | digit;
+    }
+    parser->p += 4;
+    return TRUE;
+}
+
+/* Returns newly allocated UTF-8 string */
+static gchar *parse_string(struct json_parser *parser)
+{
+    GString *str;
+    gunichar c, low;
+
+    if (!expect(parser, '"'))
+        return NULL;
+
+    str = g_string_new(NULL);
+    while (*parser->p != '"') {
+        if (!*parser->p) {
+            parse_error(parser, "unterminated string");
+            goto err;
+        }
+        if (*parser->p != '\\') {
+            g_string_append_c(str, *parser->p++);
+            continue;
+        }
+
+        parser->p++;
+        switch (*parser->p++) {
+        case '"': g_string_append_c(str, '"'); break;
+        case '\\': g_string_append_c(str, '\\'); break;
+        case '/': g_string_append_c(str, '/'); break;
+        case 'b': g_string_append_c(str, '\b'); break;
+        case 'f': g_string_append_c(str, '\f'); break;
+        case 'n': g_string_append_c(str, '\n'); break;
+        case 'r': g_string_append_c(str, '\r'); break;
+        case 't': g_string_append_c(str, '\t'); break;
+        case 'u':
+            if (!parse_hex4(parser, &c))
+                goto err;
+            /* Surrogate pair */
+            if (c >= 0xd800 && c < 0xdc00 && parser->p[0] == '\\' && parser->p[1] == 'u') {
+                parser->p += 2;
+                if (!parse_hex4(parser, &low))
+                    goto err;
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            }
+            g_string_append_unichar(str, c);
+            break;
+        default:
+            parse_error(parser, "invalid escape");
+            goto err;
+        }
+    }
+    parser->p++;
+
+    if (!g_utf8_validate(str->str, str->len, NULL)) {
+        parse_error(parser, "invalid UTF-8");
+        goto err;
+    }
+
+    return g_string_free(str, FALSE);
+
+err:
+    g_string_free(str, TRUE);
+    return NULL;
+}
+
+/* Parses number token, is_integer tells if it had no fraction or exponent */
+static gboolean scan_number(struct json_parser *parser, const char **end, gboolean *is_integer)
+{
+    const char *p;
+
+    skip_ws(parser);
+    p = parser->p;
+    if (*p == '-')
+        p++;
+    if (!g_ascii_isdigit(*p)) {
+        parse_error(parser, "number expected");
+        return FALSE;
+    }
+    while (g_ascii_isdigit(*p))
+        p++;
+    *is_integer = (*p != '.' && *p != 'e' && *p != 'E');
+    if (!*is_integer) {
+        if (*p == '.')
+            for (p++; g_ascii_isdigit(*p); p++);
+        if (*p == 'e' || *p == 'E') {
+            p++;
+            if (*p == '+' || *p == '-')
+                p++;
+            while (g_ascii_isdigit(*p))
+                p++;
+        }
+    }
+    *end = p;
+    return TRUE;
+}
+
+static GVariant *parse_integer(struct json_parser *parser, char type)
+{
+    const char *end;
+    gboolean is_integer;
+    gint64 i = 0;
+    guint64 u = 0;
+    gboolean in_range;
+
+    if (!scan_number(parser, &end, &is_integer))
+        return NULL;
+    if (!is_integer) {
+        parse_error(parser, "integer expected");
+        return NULL;
+    }
+
+    errno = 0;
+    if (type == 't' || type == 'u' || type == 'q' || type == 'y')
+        u = g_ascii_strtoull(parser->p, NULL, 10);
+    else
+        i = g_ascii_strtoll(parser->p, NULL, 10);
+    in_range = (errno == 0);
+
+    if ((type == 't' || type == 'u' || type == 'q' || type == 'y') && *parser->p == '-')
+        in_range = FALSE;
+
+    switch (type) {
+    case 'y': in_range = in_range && u <= G_MAXUINT8; break;
+    case 'n': in_range = in_range && i >= G_MININT16 && i <= G_MAXINT16; break;
+    case 'q': in_range = in_range && u <= G_MAXUINT16; break;
+    case 'i': in_range = in_range && i >= G_MININT32 && i <= G_MAXINT32; break;
+    case 'u': in_range = in_range && u <= G_MAXUINT32; break;
+    }
+    if (!in_range) {
+        parse_error(parser, "integer out of range");
+        return NULL;
+    }
+    parser->p = end;
+
+    switch (type) {
+    case 'y': return g_variant_new_byte(u);
+    case 'n': return g_variant_new_int16(i);
+    case 'q': return g_variant_new_uint16(u);
+    case 'i': return g_variant_new_int32(i);
+    case 'u': return g_variant_new_uint32(u);
+    case 'x': return g_variant_new_int64(i);
+    default: return g_variant_new_uint64(u);
+    }
+}
+
+static GVariant *parse_double(struct json_parser *parser)
+{
+    const char *end;
+    gboolean is_integer;
+    gdouble d;
+
+    if (!scan_number(parser, &end, &is_integer))
+        return NULL;
+    d = g_ascii_strtod(parser->p, NULL);
+    parser->p = end;
+
+    return g_variant_new_double(d);
+}
+
+/* Guesses type of 'v' contents */
+static GVariant *parse_any(struct json_parser *parser)
+{
+    const char *end;
+    gboolean is_integer;
+    gint64 i;
+
+    skip_ws(parser);
+    switch (*parser->p) {
+    case '"':
+        return parse_value(parser, G_VARIANT_TYPE_STRING);
+    case 't':
+    case 'f':
+        return parse_value(parser, G_VARIANT_TYPE_BOOLEAN);
+    case '[':
+        return parse_value(parser, G_VARIANT_TYPE("av"));
+    case '{':
+        return parse_value(parser, G_VARIANT_TYPE_VARDICT);
+    default:
+        if (!scan_number(parser, &end, &is_integer))
+            return NULL;
+        if (!is_integer)
+            return parse_double(parser);
+
+        errno = 0;
+        i = g_ascii_strtoll(parser->p, NULL, 10);
+        if (errno)
+            return parse_double(parser);
+        if (i < G_MININT32 || i > G_MAXINT32)
+            return parse_integer(parser, 'x');
+        return parse_integer(parser, 'i');
+    }
+}
+
+static GVariant *parse_array(struct json_parser *parser, const GVariantType *type)
+{
+    const GVariantType *elem_type = g_variant_type_element(type);
+    GVariantBuilder builder;
+    GVariant *elem;
+
+    if (!expect(parser, '['))
+        return NULL;
+
+    g_variant_builder_init(&builder, type);
+    if (!accept(parser, ']')) {
+        do {
+            elem = parse_value(parser, elem_type);
+            if (!elem)
+                goto err;
+            g_variant_builder_add_value(&builder, elem);
+        } while (accept(parser, ','));
+
+        if (!expect(parser, ']'))
+            goto err;
+    }
+
+    return g_variant_builder_end(&builder);
+
+err:
+    g_variant_builder_clear(&builder);
+    return NULL;
+}
+
+/* Takes ownership of str */
+static GVariant *string_to_variant(struct json_parser *parser, gchar *str, char type)
+{
+    GVariant *value;
+
+    if ((type == 'o' && !g_variant_is_object_path(str)) ||
+        (type == 'g' && !g_variant_is_signature(str))) {
+        g_free(str);
+        parse_error(parser, type == 'o' ? "invalid object path" : "invalid signature");
+        return NULL;
+    }
+    if (type == 's')
+        return g_variant_new_take_string(str);
+
+    value = type == 'o' ? g_variant_new_object_path(str) : g_variant_new_signature(str);
+    g_free(str);
+    return value;
+}
+
+/* Object keys are strings, so non-string keys are parsed from them */
+static GVariant *parse_key(struct json_parser *parser, const GVariantType *type)
+{
+    char key_type = g_variant_type_peek_string(type)[0];
+    struct json_parser key_parser = {NULL, NULL, parser->error, parser->depth};
+    gchar *key = parse_string(parser);
+    GVariant *value;
+
+    if (!key)
+        return NULL;
+
+    if (key_type == 's' || key_type == 'o' || key_type == 'g')
+        return string_to_variant(parser, key, key_type);
+
+    key_parser.start = key_parser.p = key;
+    value = parse_value(&key_parser, type);
+    if (value && *key_parser.p) {
+        g_variant_unref(g_variant_ref_sink(value));
+        value = NULL;
+        parse_error(parser, "invalid key");
+    }
+
+    g_free(key);
+    return value;
+}
+
+static GVariant *parse_dict(struct json_parser *parser, const GVariantType *type)
+{
+    const GVariantType *entry_type = g_variant_type_element(type);
+    const GVariantType *key_type = g_variant_type_key(entry_type);
+    const GVariantType *value_type = g_variant_type_value(entry_type);
+    GVariantBuilder builder;
+    GVariant *key, *value;
+
+    if (!expect(parser, '{'))
+        return NULL;
+
+    g_variant_builder_init(&builder, type);
+    if (!accept(parser, '}')) {
+        do {
+            key = parse_key(parser, key_type);
+            if (!key)
+                goto err;
+            if (!expect(parser, ':') || !(value = parse_value(parser, value_type))) {
+                g_variant_unref(g_variant_ref_sink(key));
+                goto err;
+            }
+            g_variant_builder_add_value(&builder, g_variant_new_dict_entry(key, value));
+        } while (accept(parser, ','));
+
+        if (!expect(parser, '}'))
+            goto err;
+    }
+
+    return g_variant_builder_end(&builder);
+
+err:
+    g_variant_builder_clear(&builder);
+    return NULL;
+}
+
+static GVariant *parse_tuple(struct json_parser *parser, const GVariantType *type)
+{
+    const GVariantType *elem_type;
+    GVariantBuilder builder;
+    GVariant *elem;
+
+    if (!expect(parser, '['))
+        return NULL;
+
+    g_variant_builder_init(&builder, type);
+    for (elem_type = g_variant_type_first(type); elem_type; elem_type = g_variant_type_next(elem_type)) {
+        if (elem_type != g_variant_type_first(type) && !expect(parser, ','))
+            goto err;
+        elem = parse_value(parser, elem_type);
+        if (!elem)
+            goto err;
+        g_variant_builder_add_value(&builder, elem);
+    }
+
+    if (!expect(parser, ']'))
+        goto err;
+
+    return g_variant_builder_end(&builder);
+
+err:
+    g_variant_builder_clear(&builder);
+    return NULL;
+}
+
+static GVariant *parse_typed(struct json_parser *parser, const GVariantType *type)
+{
+    const gchar *sig = g_variant_type_peek_string(type);
+    GVariant *value;
+    gchar *str;
+
+    switch (sig[0]) {
+    case 'b':
+        if (accept_word(parser, "true"))
+            return g_variant_new_boolean(TRUE);
+        if (accept_word(parser, "false"))
+            return g_variant_new_boolean(FALSE);
+        parse_error(parser, "boolean expected");
+        return NULL;
+    case 'y':
+    case 'n':
+    case 'q':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 't':
+        return parse_integer(parser, sig[0]);
+    case 'd':
+        return parse_double(parser);
+    case 's':
+    case 'o':
+    case 'g':
+        str = parse_string(parser);
+        return str ? string_to_variant(parser, str, sig[0]) : NULL;
+    case 'v':
+        value = parse_any(parser);
+        return value ? g_variant_new_variant(value) : NULL;
+    case 'm':
+        if (accept_word(parser, "null"))
+            return g_variant_new_maybe(g_variant_type_element(type), NULL);
+        value = parse_value(parser, g_variant_type_element(type));
+        return value ? g_variant_new_maybe(NULL, value) : NULL;
+    case 'a':
+        if (sig[1] == '{')
+            return parse_dict(parser, type);
+        return parse_array(parser, type);
+    case '(':
+        return parse_tuple(parser, type);
+    default:
+        parse_error(parser, "unsupported type");
+        return NULL;
+    }
+}
+
+static GVariant *parse_value(struct json_parser *parser, const GVariantType *type)
+{
+    GVariant *value;
+
+    if (parser->depth >= JSON_MAX_DEPTH) {
+        parse_error(parser, "nesting too deep");
+        return NULL;
+    }
+
+    parser->depth++;
+    value = parse_typed(parser, type);
+    parser->depth--;
+
+    return value;
+}
+
+/* Returns floating reference, or NULL with error set */
+GVariant *json_to_variant(const char *json, const GVariantType *type, GError **error)
+{
+    struct json_parser parser = {json, json, error, 0};
+    GVariant *value;
+
+    value = parse_value(&parser, type);
+    if (!value)
+        return NULL;
+
+    skip_ws(&parser);
+    if (*parser.p) {
+        parse_error(&parser, "trailing characters");
+        g_variant_unref(g_variant_ref_sink(value));
+        return NULL;
+    }
+
+    return value;
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+void append_json(GString *str, GVariant *value);
+GVariant *json_to_variant(const char *json, const GVariantType *type, GError **error);
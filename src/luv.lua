@@ -0,0 +1,61 @@
+--
+--  Copyright 2016, Grinn
+--
+--  SPDX-License-Identifier: MIT
+--
+
+local wrapper = {}
+
+local resume = coroutine.resume
+local running = coroutine.running
+local yield = coroutine.yield
+local unpack = unpack or table.unpack
+
+-- appends resume callback for currently running coroutine
+local function task(func, ...)
+   local n = select('#', ...)
+   local args = {...}
+   args[n+1] = resume
+   args[n+2] = running()
+   return func(unpack(args, 1, n+2))
+end
+
+function wrapper:init(easydbus, uv)
+   self.easydbus = easydbus
+   self.uv = uv
+
+   -- single fd mode: timeouts are handled by easydbus internally
+   self.poll = uv.new_poll(assert(easydbus.pollfd()))
+   self.poll:start('r', function()
+      easydbus.dispatch()
+   end)
+
+   self.restore = easydbus.wrap_async(function(func)
+      return function(...)
+         return yield(task(func, ...))
+      end
+   end)
+end
+function wrapper:close()
+   self.poll:stop()
+   self.poll:close()
+   self.poll = nil
+
+   self.restore()
+   self.easydbus.close_pollfd()
+end
+
+-- wrapping twice is a no-op
+local function wrap(easydbus, uv)
+   if not wrapper.poll then
+      wrapper:init(easydbus, uv)
+   end
+end
+
+local function unwrap()
+   if wrapper.poll then
+      wrapper:close()
+   end
+end
+
+return { wrap = wrap, unwrap = unwrap }
@@ -6,8 +6,16 @@
 
 #include "compat.h"
 #include "poll.h"
+#include "probes.h"
+#include "trace.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define EPOLL_MAX_EVENTS 16
 
 static int gio_to_epoll(int gio_events)
 {
@@ -39,7 +47,7 @@ static int epoll_to_gio(int epoll_events)
         gio_events |= G_IO_PRI;
     if (epoll_events & EPOLLERR)
         gio_events |= G_IO_ERR;
-    if (epoll_events & EPOLLIN)
+    if (epoll_events & EPOLLHUP)
         gio_events |= G_IO_HUP;
 
     return gio_events;
@@ -50,25 +58,46 @@ void gpoll_dispatch(struct easydbus_state *state)
     gboolean some_ready;
     int i;
 
-    g_debug("%s", __FUNCTION__);
+    ed_debug("%s", __FUNCTION__);
 
     for (i = 0; i < state->nfds; i++) {
-        g_debug("fd = %d", state->fds[i].fd);
-        g_debug("events = %d", state->fds[i].events);
-        g_debug("revents = %d", state->fds[i].revents);
+        ed_debug("fd = %d", state->fds[i].fd);
+        ed_debug("events = %d", state->fds[i].events);
+        ed_debug("revents = %d", state->fds[i].revents);
     }
 
     some_ready = g_main_context_check(state->context, state->max_priority, state->fds, state->nfds);
-    g_debug("%s: some_ready = %d", __FUNCTION__, (int) some_ready);
+    ed_debug("%s: some_ready = %d", __FUNCTION__, (int) some_ready);
+
+    ED_PROBE2(dispatch, state->nfds, some_ready);
+    if (some_ready)
+        trace_event(TRACE_DISPATCH, 0, NULL);
 
     g_main_context_dispatch(state->context);
 }
 
+static gboolean gpoll_budget_exhausted(struct easydbus_state *state, gint n_rounds, gint64 deadline)
+{
+    if (state->dispatch_budget > 0 && n_rounds >= state->dispatch_budget)
+        return TRUE;
+
+    if (deadline > 0 && g_get_monotonic_time() >= deadline)
+        return TRUE;
+
+    return FALSE;
+}
+
 static void gpoll_prepare(struct easydbus_state *state)
 {
-    g_debug("%s: bus = %p", __FUNCTION__, (void *) state);
+    gint n_rounds = 0;
+    gint64 deadline = 0;
+
+    ed_debug("%s: bus = %p", __FUNCTION__, (void *) state);
 
-    g_debug("before: %p %d %p %d", (void *) state->context, (int) state->max_priority, (void *) state->fds, (int) state->allocated_nfds);
+    if (state->dispatch_budget_us > 0)
+        deadline = g_get_monotonic_time() + state->dispatch_budget_us;
+
+    ed_debug("before: %p %d %p %d", (void *) state->context, (int) state->max_priority, (void *) state->fds, (int) state->allocated_nfds);
     while (1) {
         g_main_context_prepare(state->context, &state->max_priority);
 
@@ -82,11 +111,20 @@ static void gpoll_prepare(struct easydbus_state *state)
         if (state->timeout != 0)
             break;
 
-        g_debug("Timeout=%d, dispatching immediately", (int) state->timeout);
+        /* Give control back to host loop, asking it to come back immediately */
+        if (gpoll_budget_exhausted(state, n_rounds, deadline)) {
+            ed_debug("Dispatch budget exhausted after %d rounds", n_rounds);
+            state->dispatch_budget_hits++;
+            break;
+        }
+
+        ed_debug("Timeout=%d, dispatching immediately", (int) state->timeout);
         g_poll(state->fds, state->nfds, 0);
         gpoll_dispatch(state);
+        state->dispatch_rounds++;
+        n_rounds++;
     }
-    g_debug("after: %p %d %p %d", (void *) state->context, (int) state->max_priority, (void *) state->fds, (int) state->allocated_nfds);
+    ed_debug("after: %p %d %p %d", (void *) state->context, (int) state->max_priority, (void *) state->fds, (int) state->allocated_nfds);
 }
 
 static void push_epoll_fds(lua_State *L, struct easydbus_state *state)
@@ -117,7 +155,7 @@ void update_epoll(lua_State *L, struct easydbus_state *state)
     int cb_index;
     int i;
 
-    g_debug("update_epoll %d", state->ref_cb);
+    ed_debug("update_epoll %d", state->ref_cb);
 
     if (state->ref_cb >= 0) {
         lua_rawgeti(L, LUA_REGISTRYINDEX, state->ref_cb);
@@ -153,7 +191,7 @@ void gpoll_fds_set(struct easydbus_state *state, int fd, int revents)
 
     for (i = 0; i < state->nfds; i++) {
         if (state->fds[i].fd == fd) {
-            g_debug("Found FD=%d, setting revents=%d", (int) fd, (int) revents);
+            ed_debug("Found FD=%d, setting revents=%d", (int) fd, (int) revents);
             state->fds[i].revents = epoll_to_gio(revents);
             break;
         }
@@ -162,3 +200,210 @@ void gpoll_fds_set(struct easydbus_state *state, int fd, int revents)
     if (i >= state->nfds)
         g_error("Didn't found FD");
 }
+
+/*
+ * Single fd mode
+ *
+ * All GMainContext fds are kept in an internal epoll instance together with
+ * a timerfd armed with the context timeout. The host loop watches only
+ * epoll_fd (level-triggered, readable) and calls epoll_mode_dispatch().
+ */
+static void epoll_fds_set(struct easydbus_state *state, int fd, int revents)
+{
+    int i;
+
+    /* The same fd may be polled by more than one source */
+    for (i = 0; i < state->nfds; i++) {
+        if (state->fds[i].fd == fd)
+            state->fds[i].revents = epoll_to_gio(revents) & (state->fds[i].events | G_IO_ERR | G_IO_HUP);
+    }
+}
+
+static void epoll_ctl_fd(struct easydbus_state *state, int op, int fd, int events)
+{
+    struct epoll_event ev;
+    int ret;
+
+    ev.events = gio_to_epoll(events);
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+
+    ret = epoll_ctl(state->epoll_fd, op, fd, &ev);
+
+    /*
+     * Kernel drops closed fds from epoll on its own, so fd number might have
+     * been reused meanwhile (e.g. on reconnect) or be gone already.
+     */
+    if (ret < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+        ret = epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    else if (ret < 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+        ret = epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    else if (ret < 0 && op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+        ret = 0;
+
+    if (ret < 0)
+        g_warning("epoll_ctl(%d, %d) failed: %s", op, fd, g_strerror(errno));
+}
+
+static GPollFD *find_fd(GPollFD *fds, gint nfds, int fd)
+{
+    int i;
+
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].fd == fd)
+            return &fds[i];
+    }
+
+    return NULL;
+}
+
+static void epoll_sync_fds(struct easydbus_state *state)
+{
+    GPollFD *fds = g_new(GPollFD, state->nfds);
+    GPollFD *fd_rec;
+    gint nfds = 0;
+    gboolean changed = FALSE;
+    int i;
+
+    /* Merge events of duplicated fds, as epoll accepts each fd only once */
+    for (i = 0; i < state->nfds; i++) {
+        fd_rec = find_fd(fds, nfds, state->fds[i].fd);
+        if (fd_rec) {
+            fd_rec->events |= state->fds[i].events;
+        } else {
+            fds[nfds].fd = state->fds[i].fd;
+            fds[nfds].events = state->fds[i].events;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+    }
+
+    for (i = 0; i < state->epoll_nfds; i++) {
+        if (!find_fd(fds, nfds, state->epoll_fds[i].fd)) {
+            epoll_ctl_fd(state, EPOLL_CTL_DEL, state->epoll_fds[i].fd, 0);
+            changed = TRUE;
+        }
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (!find_fd(state->epoll_fds, state->epoll_nfds, fds[i].fd))
+            changed = TRUE;
+    }
+
+    /*
+     * Unchanged fds are left alone, to keep dispatch at one epoll_wait().
+     * When sources came or went, kept fds are modified as well: fd with the
+     * same number might be a new one, which closed predecessor left out of
+     * epoll, and epoll_ctl_fd() adds it back on ENOENT.
+     */
+    for (i = 0; i < nfds; i++) {
+        fd_rec = find_fd(state->epoll_fds, state->epoll_nfds, fds[i].fd);
+        if (!fd_rec)
+            epoll_ctl_fd(state, EPOLL_CTL_ADD, fds[i].fd, fds[i].events);
+        else if (changed || fd_rec->events != fds[i].events)
+            epoll_ctl_fd(state, EPOLL_CTL_MOD, fds[i].fd, fds[i].events);
+    }
+
+    g_free(state->epoll_fds);
+    state->epoll_fds = fds;
+    state->epoll_nfds = nfds;
+}
+
+static void epoll_arm_timer(struct easydbus_state *state)
+{
+    struct itimerspec its = {{0, 0}, {0, 0}};
+
+    if (state->timeout == 0) {
+        /* Make epoll_fd readable right away */
+        its.it_value.tv_nsec = 1;
+    } else if (state->timeout > 0) {
+        its.it_value.tv_sec = state->timeout / 1000;
+        its.it_value.tv_nsec = (state->timeout % 1000) * 1000000;
+    }
+
+    if (timerfd_settime(state->timer_fd, 0, &its, NULL) < 0)
+        g_warning("timerfd_settime failed: %s", g_strerror(errno));
+}
+
+static void epoll_mode_update(struct easydbus_state *state)
+{
+    gpoll_prepare(state);
+    epoll_sync_fds(state);
+    epoll_arm_timer(state);
+}
+
+int epoll_mode_init(struct easydbus_state *state)
+{
+    struct epoll_event ev;
+
+    if (state->epoll_fd >= 0)
+        return state->epoll_fd;
+
+    state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epoll_fd < 0)
+        return -1;
+
+    state->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (state->timer_fd < 0)
+        goto close_epoll;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.fd = state->timer_fd;
+    if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, state->timer_fd, &ev) < 0)
+        goto close_timer;
+
+    epoll_mode_update(state);
+
+    return state->epoll_fd;
+
+close_timer:
+    close(state->timer_fd);
+    state->timer_fd = -1;
+close_epoll:
+    close(state->epoll_fd);
+    state->epoll_fd = -1;
+    return -1;
+}
+
+void epoll_mode_dispatch(struct easydbus_state *state)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    uint64_t expirations;
+    int i, n;
+
+    ed_debug("%s", __FUNCTION__);
+
+    gpoll_fds_clear(state);
+
+    /* Events left over (more than EPOLL_MAX_EVENTS) are reported on next call */
+    n = epoll_wait(state->epoll_fd, events, EPOLL_MAX_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        if (events[i].data.fd == state->timer_fd) {
+            if (read(state->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                g_warning("timerfd read failed: %s", g_strerror(errno));
+            continue;
+        }
+
+        epoll_fds_set(state, events[i].data.fd, events[i].events);
+    }
+
+    gpoll_dispatch(state);
+
+    epoll_mode_update(state);
+}
+
+void epoll_mode_close(struct easydbus_state *state)
+{
+    if (state->epoll_fd < 0)
+        return;
+
+    close(state->timer_fd);
+    close(state->epoll_fd);
+    state->timer_fd = -1;
+    state->epoll_fd = -1;
+
+    g_free(state->epoll_fds);
+    state->epoll_fds = NULL;
+    state->epoll_nfds = 0;
+}
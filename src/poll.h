@@ -12,3 +12,7 @@ void gpoll_dispatch(struct easydbus_state *state);
 void update_epoll(lua_State *L, struct easydbus_state *state);
 void gpoll_fds_clear(struct easydbus_state *state);
 void gpoll_fds_set(struct easydbus_state *state, int fd, int revents);
+
+int epoll_mode_init(struct easydbus_state *state);
+void epoll_mode_dispatch(struct easydbus_state *state);
+void epoll_mode_close(struct easydbus_state *state);
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "probes.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+/* Semaphores are found by tracers in .probes section */
+#define ED_PROBE_DEFINE(name) \
+    unsigned short ED_PROBE_SEMAPHORE(name) __attribute__((section(".probes")))
+
+ED_PROBE_DEFINE(call_send);
+ED_PROBE_DEFINE(call_reply);
+ED_PROBE_DEFINE(method_call);
+ED_PROBE_DEFINE(method_return);
+ED_PROBE_DEFINE(signal);
+ED_PROBE_DEFINE(dispatch);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+/*
+ * USDT probes, compiled in when sys/sdt.h is available. Each probe has a
+ * semaphore, which is raised by the tracer when attached, so with nobody
+ * tracing a probe site costs one load and a predicted branch, and its
+ * arguments are not evaluated. All timestamps are g_get_monotonic_time()
+ * values.
+ *
+ * easydbus:call_send(serial, member, start_us)
+ * easydbus:call_reply(serial, member, start_us, error)
+ * easydbus:method_call(serial, member, start_us)
+ * easydbus:method_return(serial, member, start_us, error)
+ * easydbus:signal(serial, member, now_us, sender, path)
+ * easydbus:dispatch(nfds, some_ready)
+ *
+ * start_us of call_reply and method_return is the time when call was sent
+ * or handled respectively, so latency is simply now - start_us.
+ *
+ * Synchronous calls fire call_send before the message is sent, when its
+ * serial is not assigned yet, so serial is 0 there. Signal subscriptions
+ * do not get the message from GDBus, so serial of signal is always 0.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ED_PROBE_SEMAPHORE(name) easydbus_##name##_semaphore
+#define ED_PROBE_ENABLED(name) __builtin_expect(ED_PROBE_SEMAPHORE(name) != 0, 0)
+
+extern unsigned short ED_PROBE_SEMAPHORE(call_send);
+extern unsigned short ED_PROBE_SEMAPHORE(call_reply);
+extern unsigned short ED_PROBE_SEMAPHORE(method_call);
+extern unsigned short ED_PROBE_SEMAPHORE(method_return);
+extern unsigned short ED_PROBE_SEMAPHORE(signal);
+extern unsigned short ED_PROBE_SEMAPHORE(dispatch);
+
+#define ED_PROBE2(name, a1, a2) \
+    do { if (ED_PROBE_ENABLED(name)) STAP_PROBE2(easydbus, name, a1, a2); } while (0)
+#define ED_PROBE3(name, a1, a2, a3) \
+    do { if (ED_PROBE_ENABLED(name)) STAP_PROBE3(easydbus, name, a1, a2, a3); } while (0)
+#define ED_PROBE4(name, a1, a2, a3, a4) \
+    do { if (ED_PROBE_ENABLED(name)) STAP_PROBE4(easydbus, name, a1, a2, a3, a4); } while (0)
+#define ED_PROBE5(name, a1, a2, a3, a4, a5) \
+    do { if (ED_PROBE_ENABLED(name)) STAP_PROBE5(easydbus, name, a1, a2, a3, a4, a5); } while (0)
+
+#else
+
+#define ED_PROBE_ENABLED(name) 0
+
+#define ED_PROBE2(name, a1, a2) do { } while (0)
+#define ED_PROBE3(name, a1, a2, a3) do { } while (0)
+#define ED_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define ED_PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "queue.h"
+#include "filter.h"
+
+/*
+ * Messages handed to GDBus are written by its worker thread in serial order,
+ * and outgoing filter sees each of them right before it is written. So
+ * every recorded message with serial up to the last one seen by filter has
+ * left the queue.
+ */
+
+struct queued_message {
+    guint32 serial;
+    gsize size;
+};
+
+/*
+ * One per connection, shared by all bus objects wrapping it and kept until
+ * connection is disposed, so high water mark outlives bus objects.
+ */
+#define OUTGOING_QUEUE_KEY "easydbus-outgoing-queue"
+
+struct outgoing_queue {
+    struct conn_filter filter;
+    GMutex lock;
+    GQueue messages;
+    guint32 last_sent;
+    guint64 bytes;
+    guint64 max_bytes;
+    guint max_messages;
+    guint64 high_water_bytes;   /* 0 if not limited */
+    guint high_water_messages;  /* 0 if not limited */
+    gboolean wait;
+};
+
+static void outgoing_queue_free(gpointer data)
+{
+    struct outgoing_queue *queue = data;
+
+    g_queue_clear_full(&queue->messages, g_free);
+    g_mutex_clear(&queue->lock);
+    g_free(queue);
+}
+
+/* Must be called with lock held */
+static void drop_sent(struct outgoing_queue *queue)
+{
+    struct queued_message *message;
+
+    while ((message = g_queue_peek_head(&queue->messages)) && message->serial <= queue->last_sent) {
+        queue->bytes -= message->size;
+        g_free(g_queue_pop_head(&queue->messages));
+    }
+}
+
+/* Called from GDBus worker thread */
+static GDBusMessage *outgoing_queue_filter(GDBusConnection *conn, GDBusMessage *message,
+                                           gboolean incoming, gpointer user_data)
+{
+    struct outgoing_queue *queue = user_data;
+    guint32 serial;
+
+    if (incoming)
+        return message;
+
+    serial = g_dbus_message_get_serial(message);
+
+    g_mutex_lock(&queue->lock);
+    if (serial > queue->last_sent) {
+        queue->last_sent = serial;
+        drop_sent(queue);
+    }
+    g_mutex_unlock(&queue->lock);
+
+    return message;
+}
+
+/* Called when connection is disposed, once its worker is stopped */
+static void outgoing_queue_release(gpointer data, GObject *conn)
+{
+    struct outgoing_queue *queue = data;
+
+    conn_filter_remove(&queue->filter);
+    conn_filter_unref(queue);
+}
+
+struct outgoing_queue *outgoing_queue_get(GDBusConnection *conn)
+{
+    struct outgoing_queue *queue = g_object_get_data(G_OBJECT(conn), OUTGOING_QUEUE_KEY);
+
+    if (queue)
+        return queue;
+
+    queue = g_new0(struct outgoing_queue, 1);
+    g_mutex_init(&queue->lock);
+    g_queue_init(&queue->messages);
+    conn_filter_add(&queue->filter, conn, outgoing_queue_filter, outgoing_queue_free);
+
+    g_object_set_data(G_OBJECT(conn), OUTGOING_QUEUE_KEY, queue);
+    g_object_weak_ref(G_OBJECT(conn), outgoing_queue_release, queue);
+
+    return queue;
+}
+
+/* Records message just handed to GDBus, size is its body size */
+void outgoing_queue_add(struct outgoing_queue *queue, guint32 serial, gsize size)
+{
+    struct queued_message *message;
+
+    g_mutex_lock(&queue->lock);
+
+    /* Filter might have seen it already */
+    if (serial > queue->last_sent) {
+        message = g_new(struct queued_message, 1);
+        message->serial = serial;
+        message->size = size;
+        g_queue_push_tail(&queue->messages, message);
+
+        queue->bytes += size;
+        queue->max_bytes = MAX(queue->max_bytes, queue->bytes);
+        queue->max_messages = MAX(queue->max_messages, g_queue_get_length(&queue->messages));
+    }
+
+    g_mutex_unlock(&queue->lock);
+}
+
+gboolean outgoing_queue_full(struct outgoing_queue *queue)
+{
+    gboolean full;
+
+    g_mutex_lock(&queue->lock);
+    full = (queue->high_water_bytes && queue->bytes >= queue->high_water_bytes) ||
+           (queue->high_water_messages && g_queue_get_length(&queue->messages) >= queue->high_water_messages);
+    g_mutex_unlock(&queue->lock);
+
+    return full;
+}
+
+void outgoing_queue_set_high_water(struct outgoing_queue *queue, guint64 bytes, guint messages, gboolean wait)
+{
+    g_mutex_lock(&queue->lock);
+    queue->high_water_bytes = bytes;
+    queue->high_water_messages = messages;
+    queue->wait = wait;
+    g_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Pushes { messages, bytes, max_messages, max_bytes, high_water_messages,
+ * high_water_bytes, wait }
+ */
+void push_outgoing_queue(lua_State *L, struct outgoing_queue *queue)
+{
+    guint messages, max_messages, high_water_messages;
+    guint64 bytes, max_bytes, high_water_bytes;
+    gboolean wait;
+
+    /* Lua might raise memory error, so do not push with lock held */
+    g_mutex_lock(&queue->lock);
+    messages = g_queue_get_length(&queue->messages);
+    max_messages = queue->max_messages;
+    high_water_messages = queue->high_water_messages;
+    bytes = queue->bytes;
+    max_bytes = queue->max_bytes;
+    high_water_bytes = queue->high_water_bytes;
+    wait = queue->wait;
+    g_mutex_unlock(&queue->lock);
+
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, messages);
+    lua_setfield(L, -2, "messages");
+    lua_pushinteger(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, max_messages);
+    lua_setfield(L, -2, "max_messages");
+    lua_pushinteger(L, max_bytes);
+    lua_setfield(L, -2, "max_bytes");
+    lua_pushinteger(L, high_water_messages);
+    lua_setfield(L, -2, "high_water_messages");
+    lua_pushinteger(L, high_water_bytes);
+    lua_setfield(L, -2, "high_water_bytes");
+    lua_pushboolean(L, wait);
+    lua_setfield(L, -2, "wait");
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <gio/gio.h>
+
+struct outgoing_queue;
+
+struct outgoing_queue *outgoing_queue_get(GDBusConnection *conn);
+void outgoing_queue_add(struct outgoing_queue *queue, guint32 serial, gsize size);
+gboolean outgoing_queue_full(struct outgoing_queue *queue);
+void outgoing_queue_set_high_water(struct outgoing_queue *queue, guint64 bytes, guint messages, gboolean wait);
+void push_outgoing_queue(lua_State *L, struct outgoing_queue *queue);
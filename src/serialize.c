@@ -0,0 +1,329 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "serialize.h"
+
+#include "buffer.h"
+#include "compat.h"
+#include "utils.h"
+
+#include <gio/gio.h>
+#include <string.h>
+
+/*
+ * Values are serialized as GVariant tuple of given signature, in host byte
+ * order, the same way as they are laid out in D-Bus message body.
+ */
+
+static int snapshot_mt;
+#define SNAPSHOT_MT ((void *) &snapshot_mt)
+
+struct easydbus_snapshot {
+    GVariant *value;
+};
+
+static struct easydbus_snapshot *check_snapshot(lua_State *L, int index)
+{
+    struct easydbus_snapshot *snapshot = lua_touserdata(L, index);
+    int is_snapshot = 0;
+
+    if (snapshot && lua_getmetatable(L, index)) {
+        lua_pushlightuserdata(L, SNAPSHOT_MT);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        is_snapshot = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+
+    luaL_argcheck(L, is_snapshot, index, "snapshot expected");
+
+    return snapshot;
+}
+
+/* Returns newly allocated tuple type string, raises error if invalid */
+static gchar *check_tuple_sig(lua_State *L, int index)
+{
+    const char *sig = luaL_checkstring(L, index);
+    gchar *tuple_sig = g_strdup_printf("(%s)", sig);
+
+    if (!g_variant_type_string_is_valid(tuple_sig)) {
+        g_free(tuple_sig);
+        luaL_argerror(L, index, "Invalid signature");
+    }
+
+    return tuple_sig;
+}
+
+/*
+ * Args:
+ * 1) signature (nil guesses types, as in bus:call())
+ * 2) values ...
+ */
+static int easydbus_serialize(lua_State *L)
+{
+    const char *sig = lua_tostring(L, 1);
+    GVariant *value;
+
+    /* range_to_tuple() aborts on invalid signature */
+    if (sig) {
+        gchar *tuple_sig = check_tuple_sig(L, 1);
+        gsize n_items = g_variant_type_n_items(G_VARIANT_TYPE(tuple_sig));
+
+        g_free(tuple_sig);
+        if (n_items != (gsize) lua_gettop(L) - 1)
+            return luaL_argerror(L, 1, "Signature does not match number of values");
+    }
+
+    value = g_variant_ref_sink(range_to_tuple(L, 2, lua_gettop(L) + 1, sig, NULL));
+    lua_pushlstring(L, g_variant_get_data(value), g_variant_get_size(value));
+    g_variant_unref(value);
+
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) signature
+ * 2) string or buffer
+ */
+static int easydbus_deserialize(lua_State *L)
+{
+    struct easydbus_buffer *buffer = test_buffer(L, 2);
+    gchar *tuple_sig = check_tuple_sig(L, 1);
+    const guchar *data;
+    size_t size;
+    GBytes *bytes;
+    GVariant *value;
+    int ret;
+
+    if (buffer) {
+        data = buffer_data(buffer, &size);
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        data = (const guchar *) lua_tolstring(L, 2, &size);
+    } else {
+        g_free(tuple_sig);
+        return luaL_argerror(L, 2, "string or buffer expected");
+    }
+
+    /* Copy, as GVariant requires aligned data and must not outlive string */
+    bytes = g_bytes_new(data, size);
+    value = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(tuple_sig), bytes, FALSE));
+    g_bytes_unref(bytes);
+    g_free(tuple_sig);
+
+    if (!g_variant_is_normal_form(value)) {
+        g_variant_unref(value);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Invalid serialized data");
+        return 2;
+    }
+
+    ret = push_tuple(L, value, NULL);
+    g_variant_unref(value);
+
+    return ret;
+}
+
+/*
+ * Maps file with serialized values read-only. Values are converted to Lua
+ * only when accessed with snapshot:get().
+ *
+ * Args:
+ * 1) path
+ * 2) signature
+ */
+static int easydbus_load(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    gchar *tuple_sig = check_tuple_sig(L, 2);
+    struct easydbus_snapshot *snapshot;
+    GMappedFile *file;
+    GError *error = NULL;
+    GBytes *bytes;
+
+    file = g_mapped_file_new(path, FALSE, &error);
+    if (!file) {
+        g_free(tuple_sig);
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    /* Bytes keep file mapped as long as value is referenced */
+    bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+
+    snapshot = lua_newuserdata(L, sizeof(*snapshot));
+    snapshot->value = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(tuple_sig), bytes, FALSE));
+    g_bytes_unref(bytes);
+    g_free(tuple_sig);
+
+    lua_pushlightuserdata(L, SNAPSHOT_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+/*
+ * Args:
+ * 1) GVariant ** for result
+ * 2) key signature
+ * 3) key
+ */
+static int key_to_tuple(lua_State *L)
+{
+    GVariant **key_tuple = lua_touserdata(L, 1);
+
+    *key_tuple = g_variant_ref_sink(range_to_tuple(L, 3, 4, lua_tostring(L, 2), NULL));
+    return 0;
+}
+
+/*
+ * Stores entry of dictionary with key equal to Lua value at index, or NULL.
+ * Returns FALSE with error message pushed if key can't be converted, so
+ * caller can drop its references before raising it.
+ */
+static gboolean dict_lookup(lua_State *L, GVariant *dict, int index, GVariant **value)
+{
+    gchar key_sig[2] = {g_variant_get_type_string(dict)[2], '\0'};
+    GVariant *key_tuple = NULL, *key, *entry, *entry_key;
+    gsize i, n;
+
+    /* Containers are not valid keys */
+    lua_pushcfunction(L, key_to_tuple);
+    lua_pushlightuserdata(L, &key_tuple);
+    lua_pushstring(L, key_sig);
+    lua_pushvalue(L, index);
+    if (lua_pcall(L, 3, 0, 0))
+        return FALSE;
+
+    *value = NULL;
+    key = g_variant_get_child_value(key_tuple, 0);
+    g_variant_unref(key_tuple);
+
+    n = g_variant_n_children(dict);
+    for (i = 0; i < n && !*value; i++) {
+        entry = g_variant_get_child_value(dict, i);
+        entry_key = g_variant_get_child_value(entry, 0);
+        if (g_variant_equal(key, entry_key))
+            *value = g_variant_get_child_value(entry, 1);
+        g_variant_unref(entry_key);
+        g_variant_unref(entry);
+    }
+
+    g_variant_unref(key);
+
+    return TRUE;
+}
+
+/*
+ * Walks down the path of keys: tuple and array elements are indexed from 1,
+ * dictionaries by their keys and variants are unwrapped. Only the selected
+ * value is converted to Lua, nil is returned if it does not exist.
+ */
+static int snapshot_get(lua_State *L)
+{
+    struct easydbus_snapshot *snapshot = check_snapshot(L, 1);
+    GVariant *value = g_variant_ref(snapshot->value);
+    GVariant *child;
+    lua_Integer n;
+    int i, ret, top = lua_gettop(L);
+
+    for (i = 2; i <= top && value; i++) {
+        while (g_variant_is_of_type(value, G_VARIANT_TYPE_VARIANT)) {
+            child = g_variant_get_variant(value);
+            g_variant_unref(value);
+            value = child;
+        }
+
+        child = NULL;
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_DICTIONARY)) {
+            if (!dict_lookup(L, value, i, &child)) {
+                g_variant_unref(value);
+                return lua_error(L);
+            }
+        } else if (g_variant_is_container(value) && lua_type(L, i) == LUA_TNUMBER) {
+            n = lua_tointeger(L, i);
+            if (n >= 1 && (gsize) n <= g_variant_n_children(value))
+                child = g_variant_get_child_value(value, n - 1);
+        }
+
+        g_variant_unref(value);
+        value = child;
+    }
+
+    if (!value) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ret = push_variant(L, value, NULL);
+    g_variant_unref(value);
+
+    return ret;
+}
+
+static int snapshot_type(lua_State *L)
+{
+    struct easydbus_snapshot *snapshot = check_snapshot(L, 1);
+    const gchar *type = g_variant_get_type_string(snapshot->value);
+
+    /* Strip tuple parentheses */
+    lua_pushlstring(L, type + 1, strlen(type) - 2);
+    return 1;
+}
+
+static int snapshot__len(lua_State *L)
+{
+    struct easydbus_snapshot *snapshot = check_snapshot(L, 1);
+
+    lua_pushinteger(L, g_variant_n_children(snapshot->value));
+    return 1;
+}
+
+static int snapshot__gc(lua_State *L)
+{
+    struct easydbus_snapshot *snapshot = check_snapshot(L, 1);
+
+    g_variant_unref(snapshot->value);
+    return 0;
+}
+
+static luaL_Reg snapshot_funcs[] = {
+    {"get", snapshot_get},
+    {"type", snapshot_type},
+    {"__len", snapshot__len},
+    {"__gc", snapshot__gc},
+    {NULL, NULL},
+};
+
+static luaL_Reg module_funcs[] = {
+    {"serialize", easydbus_serialize},
+    {"deserialize", easydbus_deserialize},
+    {"load", easydbus_load},
+    {NULL, NULL},
+};
+
+/*
+ * Adds serialization functions to module table at index 1 and returns
+ * snapshot methods table.
+ */
+int luaopen_easydbus_serialize(lua_State *L)
+{
+    luaL_setfuncs(L, module_funcs, 0);
+
+    luaL_newlibtable(L, snapshot_funcs);
+    luaL_setfuncs(L, snapshot_funcs, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushlightuserdata(L, SNAPSHOT_MT);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    return 1;
+}
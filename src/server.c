@@ -0,0 +1,258 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "server.h"
+
+#include "bus.h"
+#include "compat.h"
+#include "easydbus.h"
+
+#include <unistd.h>
+
+struct easydbus_server {
+    struct easydbus_state *state;
+    GDBusServer *server;
+    GDBusAuthObserver *observer;
+    gulong handler_id;
+    int ref;
+};
+
+static int server_mt;
+#define SERVER_MT ((void *) &server_mt)
+
+static struct easydbus_server *get_server(lua_State *L, int index)
+{
+    struct easydbus_server *server = lua_touserdata(L, index);
+
+    luaL_argcheck(L, server && server->server, index, "Server is stopped");
+
+    return server;
+}
+
+static void on_connection_closed(GDBusConnection *conn,
+                                 gboolean remote_peer_vanished,
+                                 GError *error,
+                                 gpointer user_data)
+{
+    struct easydbus_state *state = user_data;
+
+    ed_debug("%s: conn=%p", __FUNCTION__, (void *) conn);
+
+    lua_pushlightuserdata(state->L, conn);
+    lua_pushnil(state->L);
+    lua_rawset(state->L, LUA_REGISTRYINDEX);
+}
+
+/*
+ * Only accept peers running as the same user as this process.
+ */
+static gboolean on_authorize_peer(GDBusAuthObserver *observer,
+                                  GIOStream *stream,
+                                  GCredentials *credentials,
+                                  gpointer user_data)
+{
+    GError *error = NULL;
+    uid_t uid;
+
+    if (!credentials) {
+        ed_debug("%s: no peer credentials", __FUNCTION__);
+        return FALSE;
+    }
+
+    uid = g_credentials_get_unix_user(credentials, &error);
+    if (error) {
+        ed_debug("%s: %s", __FUNCTION__, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    return uid == getuid();
+}
+
+static gboolean on_new_connection(GDBusServer *gserver,
+                                  GDBusConnection *conn,
+                                  gpointer user_data)
+{
+    struct easydbus_server *server = user_data;
+    struct easydbus_state *state = server->state;
+    struct easydbus_conn *bus;
+    lua_State *T;
+    int n_args;
+    int i;
+    int ret;
+
+    ed_debug("%s: conn=%p", __FUNCTION__, (void *) conn);
+
+    T = lua_newthread(state->L);
+
+    /* push callback with args */
+    lua_rawgeti(T, LUA_REGISTRYINDEX, server->ref);
+    lua_getfield(T, 1, "n");
+    n_args = lua_tointeger(T, -1);
+    lua_pop(T, 1);
+    for (i = 1; i <= n_args; i++) {
+        lua_rawgeti(T, 1, i);
+    }
+    lua_remove(T, 1);
+
+    push_conn(T, state, g_object_ref(conn), TRUE);
+    bus = lua_touserdata(T, -1);
+
+    /* Keep peer connection alive until it gets closed */
+    lua_pushlightuserdata(T, conn);
+    lua_pushvalue(T, -2);
+    lua_rawset(T, LUA_REGISTRYINDEX);
+    bus->closed_id = g_signal_connect(conn, "closed", G_CALLBACK(on_connection_closed), state);
+
+    ret = ed_resume(T, n_args);
+    if (ret && ret != LUA_YIELD)
+        g_warning("new connection handler error: %s", lua_tostring(T, -1));
+
+    lua_pop(state->L, 1);
+
+    return TRUE;
+}
+
+static void server_stop(struct easydbus_server *server)
+{
+    if (!server->server)
+        return;
+
+    g_dbus_server_stop(server->server);
+    g_signal_handler_disconnect(server->server, server->handler_id);
+    g_object_unref(server->server);
+    g_object_unref(server->observer);
+    server->server = NULL;
+
+    luaL_unref(server->state->L, LUA_REGISTRYINDEX, server->ref);
+}
+
+static int server_address(lua_State *L)
+{
+    struct easydbus_server *server = get_server(L, 1);
+
+    lua_pushstring(L, g_dbus_server_get_client_address(server->server));
+    return 1;
+}
+
+static int server_stop_lua(lua_State *L)
+{
+    struct easydbus_server *server = get_server(L, 1);
+
+    server_stop(server);
+
+    return 0;
+}
+
+static int server__gc(lua_State *L)
+{
+    struct easydbus_server *server = lua_touserdata(L, 1);
+
+    ed_debug("%s %p", __FUNCTION__, (void *) server);
+
+    server_stop(server);
+
+    return 0;
+}
+
+static luaL_Reg server_funcs[] = {
+    {"address", server_address},
+    {"stop", server_stop_lua},
+    {"__gc", server__gc},
+    {NULL, NULL},
+};
+
+/*
+ * Args:
+ * 1) listen address, e.g. "unix:path=/run/service" or "unix:tmpdir=/tmp"
+ * 2) new connection handler
+ * 3) handler args ... (optional)
+ */
+static int new_server(lua_State *L)
+{
+    struct easydbus_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    const char *address = luaL_checkstring(L, 1);
+    int n_params = lua_gettop(L);
+    struct easydbus_server *server;
+    GDBusServer *gserver;
+    GDBusAuthObserver *observer;
+    GError *error = NULL;
+    gchar *guid;
+    int i;
+
+    luaL_argcheck(L, g_dbus_is_supported_address(address, NULL), 1, "Unsupported address");
+    luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "Connection handler not specified");
+
+    observer = g_dbus_auth_observer_new();
+    g_signal_connect(observer, "authorize-authenticated-peer",
+                     G_CALLBACK(on_authorize_peer), NULL);
+
+    guid = g_dbus_generate_guid();
+    gserver = g_dbus_server_new_sync(address,
+                                     G_DBUS_SERVER_FLAGS_NONE,
+                                     guid,
+                                     observer,
+                                     NULL, /* cancellable */
+                                     &error);
+    g_free(guid);
+
+    if (!gserver) {
+        g_object_unref(observer);
+        lua_pushnil(L);
+        lua_pushstring(L, error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    server = lua_newuserdata(L, sizeof(*server));
+    server->state = state;
+    server->server = gserver;
+    server->observer = observer;
+
+    lua_pushlightuserdata(L, SERVER_MT);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, n_params - 1, 1);
+    for (i = 2; i <= n_params; i++) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i - 1);
+    }
+    lua_pushinteger(L, n_params - 1);
+    lua_setfield(L, -2, "n");
+    server->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    server->handler_id = g_signal_connect(gserver, "new-connection",
+                                          G_CALLBACK(on_new_connection), server);
+
+    g_dbus_server_start(gserver);
+
+    ed_debug("Created server=%p address=%s", (void *) gserver,
+             g_dbus_server_get_client_address(gserver));
+
+    return 1;
+}
+
+int luaopen_easydbus_server(lua_State *L)
+{
+    /* Set server mt */
+    luaL_newlibtable(L, server_funcs);
+    lua_pushvalue(L, 1);
+    luaL_setfuncs(L, server_funcs, 1);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -3);
+
+    /* Set server mt in registry */
+    lua_pushlightuserdata(L, SERVER_MT);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    lua_pushcclosure(L, new_server, 1);
+
+    return 1;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "stats.h"
+
+#include <string.h>
+
+/*
+ * Maps "interface.method" to struct method_stats. Entries are never removed,
+ * so pointers returned by stats_begin() stay valid as long as table is alive.
+ */
+GHashTable *stats_table_new(void)
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+void stats_table_reset(GHashTable *table)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct method_stats *stats = value;
+        gint64 in_flight = stats->in_flight;
+
+        memset(stats, 0, sizeof(*stats));
+        stats->in_flight = in_flight;
+    }
+}
+
+struct method_stats *stats_begin(GHashTable *table, const char *interface_name, const char *method_name)
+{
+    /* D-Bus limits both names to 255 characters */
+    char key[512];
+    struct method_stats *stats;
+
+    g_snprintf(key, sizeof(key), "%s.%s", interface_name, method_name);
+
+    stats = g_hash_table_lookup(table, key);
+    if (!stats) {
+        stats = g_new0(struct method_stats, 1);
+        g_hash_table_insert(table, g_strdup(key), stats);
+    }
+
+    stats->calls++;
+    stats->in_flight++;
+
+    return stats;
+}
+
+void stats_end(struct method_stats *stats, gint64 start_time, gboolean error)
+{
+    gint64 elapsed = g_get_monotonic_time() - start_time;
+    guint64 us = elapsed > 0 ? elapsed : 0;
+    guint bucket = us ? g_bit_storage(us) : 0;
+
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+
+    stats->in_flight--;
+    if (error)
+        stats->errors++;
+    stats->total_us += us;
+    if (us > stats->max_us)
+        stats->max_us = us;
+    stats->histogram[bucket]++;
+}
+
+/*
+ * Pushes table:
+ * { ["interface.method"] = { calls, errors, in_flight, total_us, max_us,
+ *                            histogram = { [upper bound in us] = count } } }
+ */
+void push_stats_table(lua_State *L, GHashTable *table)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    int i;
+
+    lua_createtable(L, 0, g_hash_table_size(table));
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct method_stats *stats = value;
+
+        lua_createtable(L, 0, 6);
+        lua_pushinteger(L, stats->calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushinteger(L, stats->errors);
+        lua_setfield(L, -2, "errors");
+        lua_pushinteger(L, stats->in_flight);
+        lua_setfield(L, -2, "in_flight");
+        lua_pushinteger(L, stats->total_us);
+        lua_setfield(L, -2, "total_us");
+        lua_pushinteger(L, stats->max_us);
+        lua_setfield(L, -2, "max_us");
+
+        lua_newtable(L);
+        for (i = 0; i < STATS_BUCKETS; i++) {
+            if (!stats->histogram[i])
+                continue;
+
+            lua_pushinteger(L, (lua_Integer) 1 << i);
+            lua_pushinteger(L, stats->histogram[i]);
+            lua_rawset(L, -3);
+        }
+        lua_setfield(L, -2, "histogram");
+
+        lua_setfield(L, -2, key);
+    }
+}
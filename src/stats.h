@@ -0,0 +1,32 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <glib.h>
+
+/* Latency histogram bucket i counts calls which took less than 2^i us */
+#define STATS_BUCKETS 24
+
+struct method_stats {
+    guint64 calls;
+    guint64 errors;
+    gint64 in_flight;
+    guint64 total_us;
+    guint64 max_us;
+    guint64 histogram[STATS_BUCKETS];
+};
+
+GHashTable *stats_table_new(void);
+void stats_table_reset(GHashTable *table);
+void push_stats_table(lua_State *L, GHashTable *table);
+
+struct method_stats *stats_begin(GHashTable *table, const char *interface_name, const char *method_name);
+void stats_end(struct method_stats *stats, gint64 start_time, gboolean error);
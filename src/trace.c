@@ -0,0 +1,90 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "trace.h"
+
+/* Must be power of 2 */
+#define TRACE_SIZE 4096
+
+/* Longer member names are truncated */
+#define TRACE_MEMBER_SIZE 32
+
+struct trace_record {
+    gint64 timestamp; /* monotonic time in us */
+    guint32 serial;
+    guint32 type;
+    guint32 seq;      /* 0 for never written slots */
+    char member[TRACE_MEMBER_SIZE];
+};
+
+gboolean trace_enabled = FALSE;
+
+static struct trace_record trace_ring[TRACE_SIZE];
+static gint trace_head;
+
+static const char *const trace_event_names[] = {
+    [TRACE_CALL] = "call",
+    [TRACE_CALL_REPLY] = "call_reply",
+    [TRACE_CALL_ERROR] = "call_error",
+    [TRACE_METHOD] = "method",
+    [TRACE_METHOD_RETURN] = "method_return",
+    [TRACE_METHOD_ERROR] = "method_error",
+    [TRACE_EMIT] = "emit",
+    [TRACE_SIGNAL] = "signal",
+    [TRACE_DISPATCH] = "dispatch",
+};
+
+/*
+ * Writers claim slots with an atomic increment and copy member name into the
+ * slot, so no lock or allocation is involved. A record being overwritten
+ * while dumped may come out torn, which is acceptable for post-mortem
+ * inspection.
+ */
+void trace_record_event(enum trace_event_type type, guint32 serial, const char *member, gint64 timestamp)
+{
+    guint seq = (guint) g_atomic_int_add(&trace_head, 1) + 1;
+    struct trace_record *record = &trace_ring[seq & (TRACE_SIZE - 1)];
+
+    record->timestamp = timestamp;
+    record->serial = serial;
+    if (member)
+        g_strlcpy(record->member, member, sizeof(record->member));
+    else
+        record->member[0] = '\0';
+    record->type = type;
+    record->seq = seq;
+}
+
+/* Pushes array of recorded events, oldest first */
+void push_trace(lua_State *L)
+{
+    guint head = (guint) g_atomic_int_get(&trace_head);
+    guint n = head < TRACE_SIZE ? head : TRACE_SIZE;
+    guint seq;
+    int i = 0;
+
+    lua_createtable(L, n, 0);
+
+    for (seq = head - n + 1; seq != head + 1; seq++) {
+        struct trace_record *record = &trace_ring[seq & (TRACE_SIZE - 1)];
+
+        if (record->seq != seq)
+            continue;
+
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, trace_event_names[record->type]);
+        lua_setfield(L, -2, "type");
+        lua_pushinteger(L, record->timestamp);
+        lua_setfield(L, -2, "time");
+        lua_pushinteger(L, record->serial);
+        lua_setfield(L, -2, "serial");
+        if (record->member[0]) {
+            lua_pushstring(L, record->member);
+            lua_setfield(L, -2, "member");
+        }
+        lua_rawseti(L, -2, ++i);
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2016, Grinn
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <glib.h>
+
+enum trace_event_type {
+    TRACE_CALL,          /* outgoing method call sent */
+    TRACE_CALL_REPLY,    /* reply to outgoing call received */
+    TRACE_CALL_ERROR,    /* outgoing call failed */
+    TRACE_METHOD,        /* incoming method call dispatched to handler */
+    TRACE_METHOD_RETURN, /* handler returned */
+    TRACE_METHOD_ERROR,  /* handler failed */
+    TRACE_EMIT,          /* signal emitted */
+    TRACE_SIGNAL,        /* signal dispatched to subscriber */
+    TRACE_DISPATCH,      /* main context dispatch */
+};
+
+extern gboolean trace_enabled;
+
+void trace_record_event(enum trace_event_type type, guint32 serial, const char *member, gint64 timestamp);
+
+/* Cheap enough to be left in hot paths */
+static inline void trace_event(enum trace_event_type type, guint32 serial, const char *member)
+{
+    if (trace_enabled)
+        trace_record_event(type, serial, member, g_get_monotonic_time());
+}
+
+/* Records event which happened at given monotonic time */
+static inline void trace_event_at(enum trace_event_type type, guint32 serial, const char *member,
+                                  gint64 timestamp)
+{
+    if (trace_enabled)
+        trace_record_event(type, serial, member, timestamp);
+}
+
+void push_trace(lua_State *L);
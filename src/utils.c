@@ -4,11 +4,142 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include "buffer.h"
 #include "compat.h"
 #include "utils.h"
 
 #include <string.h>
 
+#ifdef EASYDBUS_DEBUG_LOG
+void debug_args(lua_State *L, int first, int last)
+{
+    int i;
+
+    for (i = first; i <= last; i++) {
+        if (lua_type(L, i) == LUA_TSTRING)
+            g_debug("arg %d: %s", i, lua_tostring(L, i));
+        else
+            g_debug("arg %d: type=%s", i, lua_typename(L, lua_type(L, i)));
+    }
+}
+#endif
+
+/*
+ * Marshalling counters. Disabled by default, so conversions only pay for
+ * a branch. Process-wide, as conversions are not tied to easydbus state.
+ */
+struct marshal_counters {
+    guint64 calls;
+    guint64 bytes;
+    guint64 time_us;
+};
+
+static struct {
+    gboolean enabled;
+    struct marshal_counters encode;
+    struct marshal_counters decode;
+    guint64 variants;
+    guint64 tables;
+    GHashTable *encode_sigs; /* signature -> struct marshal_counters */
+    GHashTable *decode_sigs;
+} marshal_stats;
+
+static void marshal_stats_add(GHashTable **sigs, struct marshal_counters *total,
+                              const char *sig, gsize bytes, gint64 start_time)
+{
+    struct marshal_counters *counters;
+    gint64 elapsed = g_get_monotonic_time() - start_time;
+
+    if (!*sigs)
+        *sigs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    counters = g_hash_table_lookup(*sigs, sig);
+    if (!counters) {
+        counters = g_new0(struct marshal_counters, 1);
+        g_hash_table_insert(*sigs, g_strdup(sig), counters);
+    }
+
+    counters->calls++;
+    counters->bytes += bytes;
+    counters->time_us += elapsed;
+
+    total->calls++;
+    total->bytes += bytes;
+    total->time_us += elapsed;
+}
+
+void marshal_stats_enable(gboolean enable)
+{
+    marshal_stats.enabled = enable;
+}
+
+void marshal_stats_reset(void)
+{
+    memset(&marshal_stats.encode, 0, sizeof(marshal_stats.encode));
+    memset(&marshal_stats.decode, 0, sizeof(marshal_stats.decode));
+    marshal_stats.variants = 0;
+    marshal_stats.tables = 0;
+
+    if (marshal_stats.encode_sigs)
+        g_hash_table_remove_all(marshal_stats.encode_sigs);
+    if (marshal_stats.decode_sigs)
+        g_hash_table_remove_all(marshal_stats.decode_sigs);
+}
+
+static void push_marshal_counters(lua_State *L, struct marshal_counters *counters)
+{
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, counters->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushinteger(L, counters->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, counters->time_us);
+    lua_setfield(L, -2, "time_us");
+}
+
+static void push_marshal_sigs(lua_State *L, GHashTable *sigs)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    lua_newtable(L);
+    if (!sigs)
+        return;
+
+    g_hash_table_iter_init(&iter, sigs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        push_marshal_counters(L, value);
+        lua_setfield(L, -2, key);
+    }
+}
+
+/*
+ * Pushes snapshot:
+ * { enabled, variants, tables,
+ *   encode = { calls, bytes, time_us, signatures = { [sig] = {...} } },
+ *   decode = { ... } }
+ */
+void push_marshal_stats(lua_State *L)
+{
+    lua_createtable(L, 0, 5);
+    lua_pushboolean(L, marshal_stats.enabled);
+    lua_setfield(L, -2, "enabled");
+    lua_pushinteger(L, marshal_stats.variants);
+    lua_setfield(L, -2, "variants");
+    lua_pushinteger(L, marshal_stats.tables);
+    lua_setfield(L, -2, "tables");
+
+    push_marshal_counters(L, &marshal_stats.encode);
+    push_marshal_sigs(L, marshal_stats.encode_sigs);
+    lua_setfield(L, -2, "signatures");
+    lua_setfield(L, -2, "encode");
+
+    push_marshal_counters(L, &marshal_stats.decode);
+    push_marshal_sigs(L, marshal_stats.decode_sigs);
+    lua_setfield(L, -2, "signatures");
+    lua_setfield(L, -2, "decode");
+}
+
 int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
 {
     GVariant *elem;
@@ -23,6 +154,8 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
 
             n = g_variant_n_children(value);
             lua_createtable(L, 0, n);
+            if (marshal_stats.enabled)
+                marshal_stats.tables++;
             for (i = 0; i < n; i++) {
                 elem = g_variant_get_child_value(value, i);
                 key = g_variant_get_child_value(elem, 0);
@@ -36,9 +169,13 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
                 g_variant_unref(key);
                 g_variant_unref(val);
             }
+        } else if (buffer_arrays && push_array_buffer(L, value)) {
+            break;
         } else {
             n = g_variant_n_children(value);
             lua_createtable(L, n, 0);
+            if (marshal_stats.enabled)
+                marshal_stats.tables++;
             for (i = 0; i < n; i++) {
                 elem = g_variant_get_child_value(value, i);
                 push_variant(L, elem, fd_list);
@@ -51,6 +188,8 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
     case G_VARIANT_CLASS_TUPLE:
         n = g_variant_n_children(value);
         lua_createtable(L, n, 0);
+        if (marshal_stats.enabled)
+            marshal_stats.tables++;
         for (i = 0; i < n; i++) {
             elem = g_variant_get_child_value(value, i);
             push_variant(L, elem, fd_list);
@@ -91,6 +230,8 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list)
         lua_pushnumber(L, g_variant_get_double(value));
         break;
     case G_VARIANT_CLASS_HANDLE:
+        if (!fd_list)
+            luaL_error(L, "FD is not supported");
         fd = g_unix_fd_list_get(fd_list, g_variant_get_handle(value), &error);
         if (fd < 0) {
             lua_pushfstring(L, "Failed to push handle: %s", error->message);
@@ -120,6 +261,10 @@ int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list)
 {
     GVariant *elem;
     gsize n, i;
+    gint64 start_time = 0;
+
+    if (marshal_stats.enabled)
+        start_time = g_get_monotonic_time();
 
     n = g_variant_n_children(value);
     for (i = 0; i < n; i++) {
@@ -128,6 +273,10 @@ int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list)
         g_variant_unref(elem);
     }
 
+    if (marshal_stats.enabled)
+        marshal_stats_add(&marshal_stats.decode_sigs, &marshal_stats.decode,
+                          g_variant_get_type_string(value), g_variant_get_size(value), start_time);
+
     return n;
 }
 
@@ -211,8 +360,9 @@ static GVariant *to_variant(lua_State *L, int index, const char *sig, GUnixFDLis
     gint handle;
     GError *error = NULL;
     gboolean is_type = FALSE;
+    struct easydbus_buffer *buffer;
 
-    g_debug("%s: index=%d sig=%s lua_type=%s", __FUNCTION__, index, sig, lua_typename(L, lua_type(L, index)));
+    ed_debug("%s: index=%d sig=%s lua_type=%s", __FUNCTION__, index, sig, lua_typename(L, lua_type(L, index)));
 
     if (sig && sig[0] != 'v') {
         if (easydbus_is_dbus_type(L, index)) {
@@ -283,7 +433,12 @@ static GVariant *to_variant(lua_State *L, int index, const char *sig, GUnixFDLis
             value = g_variant_new_object_path(str);
             break;
         case 'a':
-            value = to_array(L, index, sig, fd_list);
+            if ((buffer = test_buffer(L, index)))
+                value = buffer_to_variant(L, buffer, sig);
+            else if (sig[1] == 'y' && lua_type(L, index) == LUA_TSTRING)
+                value = string_to_bytes_variant(L, index);
+            else
+                value = to_array(L, index, sig, fd_list);
             break;
         case '(':
             value = to_tuple(L, index, sig, fd_list);
@@ -337,6 +492,12 @@ static GVariant *to_variant(lua_State *L, int index, const char *sig, GUnixFDLis
                 value = to_array(L, index, "a{sv}", fd_list);
             }
             break;
+        case LUA_TUSERDATA:
+            if ((buffer = test_buffer(L, index))) {
+                value = buffer_to_variant(L, buffer, NULL);
+                break;
+            }
+            /* fall through */
         default:
             luaL_error(L, "Unsupported output type: %s", lua_typename(L, lua_type(L, index)));
         }
@@ -349,6 +510,9 @@ static GVariant *to_variant(lua_State *L, int index, const char *sig, GUnixFDLis
     if (is_type)
         lua_pop(L, 1);
 
+    if (marshal_stats.enabled)
+        marshal_stats.variants++;
+
     return value;
 }
 
@@ -359,9 +523,14 @@ GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const cha
     int ret;
     const char *startptr, *endptr;
     char *subsig;
+    GVariant *value;
+    gint64 start_time = 0;
 
-    g_debug("%s: index_begin=%d index_end=%d sig=%s",
-            __FUNCTION__, index_begin, index_end, sig);
+    ed_debug("%s: index_begin=%d index_end=%d sig=%s",
+             __FUNCTION__, index_begin, index_end, sig);
+
+    if (marshal_stats.enabled)
+        start_time = g_get_monotonic_time();
 
     g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
     if (sig) {
@@ -380,5 +549,13 @@ GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const cha
             g_variant_builder_add_value(&builder, to_variant(L, i, NULL, fd_list));
     }
 
-    return g_variant_builder_end(&builder);
+    value = g_variant_builder_end(&builder);
+
+    if (marshal_stats.enabled) {
+        marshal_stats.variants++;
+        marshal_stats_add(&marshal_stats.encode_sigs, &marshal_stats.encode,
+                          g_variant_get_type_string(value), g_variant_get_size(value), start_time);
+    }
+
+    return value;
 }
@@ -19,3 +19,7 @@ int push_variant(lua_State *L, GVariant *value, GUnixFDList *fd_list);
 int push_tuple(lua_State *L, GVariant *value, GUnixFDList *fd_list);
 
 GVariant *range_to_tuple(lua_State *L, int index_begin, int index_end, const char *sig, GUnixFDList *fd_list);
+
+void marshal_stats_enable(gboolean enable);
+void marshal_stats_reset(void);
+void push_marshal_stats(lua_State *L);
@@ -0,0 +1,221 @@
+#!/usr/bin/env lua
+
+--
+--  Copyright 2016, Grinn
+--
+--  SPDX-License-Identifier: MIT
+--
+
+-- Replays method calls recorded with bus:capture_start() and reports
+-- throughput and latency percentiles.
+
+local dbus = require 'easydbus'
+
+local usage = [[
+Usage: replay.lua [options] capture.pcapng
+
+Options:
+  -a, --address ADDR       bus to replay on: session, system or D-Bus address (default: session)
+  -d, --destination NAME   send calls to NAME instead of recorded destination
+  -m, --member NAME        replay only calls of method NAME
+  -s, --speed N            replay N times faster than recorded, 0 for no delays (default: 1)
+  -c, --concurrency N      maximum number of calls in flight (default: 1)
+  -h, --help               show this help
+]]
+
+local function parse_args(args)
+   local opts = {address = 'session', speed = 1, concurrency = 1}
+   local names = {
+      ['-a'] = 'address', ['--address'] = 'address',
+      ['-d'] = 'destination', ['--destination'] = 'destination',
+      ['-m'] = 'member', ['--member'] = 'member',
+      ['-s'] = 'speed', ['--speed'] = 'speed',
+      ['-c'] = 'concurrency', ['--concurrency'] = 'concurrency',
+   }
+   local i = 1
+   while i <= #args do
+      local arg = args[i]
+      if arg == '-h' or arg == '--help' then
+         io.write(usage)
+         os.exit(0)
+      elseif names[arg] then
+         opts[names[arg]] = assert(args[i+1], 'Missing value of ' .. arg)
+         i = i + 1
+      else
+         opts.path = arg
+      end
+      i = i + 1
+   end
+   if not opts.path then
+      io.stderr:write(usage)
+      os.exit(1)
+   end
+   opts.speed = assert(tonumber(opts.speed), 'Invalid speed')
+   opts.concurrency = assert(tonumber(opts.concurrency), 'Invalid concurrency')
+   return opts
+end
+
+local function uint32(data, pos, big_endian)
+   local b1, b2, b3, b4 = data:byte(pos, pos + 3)
+   if big_endian then
+      b1, b2, b3, b4 = b4, b3, b2, b1
+   end
+   return b1 + b2 * 0x100 + b3 * 0x10000 + b4 * 0x1000000
+end
+
+local function uint16(data, pos, big_endian)
+   local b1, b2 = data:byte(pos, pos + 1)
+   if big_endian then
+      b1, b2 = b2, b1
+   end
+   return b1 + b2 * 0x100
+end
+
+-- Returns direction flags (1 inbound, 2 outbound) from epb_flags option
+local function epb_direction(data, pos, stop, big_endian)
+   while pos + 4 <= stop do
+      local code = uint16(data, pos, big_endian)
+      local len = uint16(data, pos + 2, big_endian)
+      if code == 0 then
+         break
+      elseif code == 2 and len == 4 then
+         return uint32(data, pos + 4, big_endian) % 4
+      end
+      pos = pos + 4 + len + (4 - len % 4) % 4
+   end
+   return 0
+end
+
+-- Returns list of {time = us, blob = message, outgoing = boolean}
+local function read_pcapng(path)
+   local file = assert(io.open(path, 'rb'))
+   local data = file:read('*a')
+   file:close()
+
+   if data:sub(1, 4) ~= '\10\13\13\10' then
+      error('Not a pcapng file: ' .. path)
+   end
+   local big_endian = data:sub(9, 12) == '\26\43\60\77'
+
+   local records = {}
+   local pos = 1
+   while pos <= #data do
+      if pos + 12 > #data + 1 then
+         io.stderr:write('Truncated block at offset ' .. (pos - 1) .. ', ignoring rest of capture\n')
+         break
+      end
+      local block_type = uint32(data, pos, big_endian)
+      local block_len = uint32(data, pos + 4, big_endian)
+      if block_len < 12 or pos + block_len > #data + 1 then
+         io.stderr:write('Truncated block at offset ' .. (pos - 1) .. ', ignoring rest of capture\n')
+         break
+      end
+
+      if block_type == 1 then
+         assert(uint16(data, pos + 8, big_endian) == 231, 'Not a D-Bus capture: ' .. path)
+      elseif block_type == 6 then
+         local ts = uint32(data, pos + 12, big_endian) * 0x100000000 + uint32(data, pos + 16, big_endian)
+         local len = uint32(data, pos + 20, big_endian)
+         local opts_pos = pos + 28 + len + (4 - len % 4) % 4
+         records[#records+1] = {
+            time = ts,
+            blob = data:sub(pos + 28, pos + 27 + len),
+            outgoing = epb_direction(data, opts_pos, pos + block_len - 4, big_endian) == 2,
+         }
+      end
+      pos = pos + block_len
+   end
+   return records
+end
+
+-- Only calls sent by the captured connection are replayed
+local function select_calls(records, opts)
+   local calls = {}
+   for _,record in ipairs(records) do
+      local info = record.outgoing and dbus.message_info(record.blob)
+      if info and info.type == 'method_call' and
+         (not opts.member or info.member == opts.member) then
+         calls[#calls+1] = record
+      end
+   end
+   return calls
+end
+
+local function sleep(us)
+   local co = coroutine.running()
+   dbus.add_timeout(math.floor(us / 1000), function()
+      coroutine.resume(co)
+   end)
+   coroutine.yield()
+end
+
+local function percentile(sorted, p)
+   if #sorted == 0 then
+      return 0
+   end
+   return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+local function replay(opts)
+   local calls = select_calls(read_pcapng(opts.path), opts)
+   local bus = assert(dbus.connect(opts.address))
+   local latencies = {}
+   local errors = 0
+   local next_call = 1
+   local running = opts.concurrency
+   local start, stop
+
+   local function worker()
+      while next_call <= #calls do
+         local call = calls[next_call]
+         next_call = next_call + 1
+
+         if opts.speed > 0 then
+            local due = start + (call.time - calls[1].time) / opts.speed
+            local now = dbus.monotonic_time()
+            if due - now >= 1000 then
+               sleep(due - now)
+            end
+         end
+
+         local t = dbus.monotonic_time()
+         local ok = bus:call_blob(call.blob, opts.destination)
+         latencies[#latencies+1] = dbus.monotonic_time() - t
+         if not ok then
+            errors = errors + 1
+         end
+      end
+
+      running = running - 1
+      if running == 0 then
+         stop = dbus.monotonic_time()
+         dbus.mainloop_quit()
+      end
+   end
+
+   if #calls == 0 then
+      print('No method calls to replay')
+      return
+   end
+
+   dbus.add_callback(function()
+      start = dbus.monotonic_time()
+      for _ = 1, opts.concurrency do
+         dbus.add_callback(worker)
+      end
+   end)
+   dbus.mainloop()
+   bus:close()
+
+   table.sort(latencies)
+   local duration = (stop - start) / 1000000
+   print(string.format('calls:      %d', #latencies))
+   print(string.format('errors:     %d', errors))
+   print(string.format('duration:   %.3f s', duration))
+   print(string.format('throughput: %.1f calls/s', #latencies / duration))
+   print(string.format('latency:    p50 %d us, p90 %d us, p99 %d us, max %d us',
+                       percentile(latencies, 0.5), percentile(latencies, 0.9),
+                       percentile(latencies, 0.99), latencies[#latencies]))
+end
+
+replay(parse_args(arg))